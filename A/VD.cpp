@@ -7,6 +7,7 @@
 #include <map>
 #include <utility>
 #include <algorithm>
+#include <numeric>
 #include <iomanip>
 #include <stack>
 #include <queue>
@@ -16,11 +17,104 @@
 #include <random>
 #include <bitset>
 #include <sstream>
+#include <immintrin.h>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <limits>
+#include <cfloat>
+#include <cstdarg>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 using namespace std;
 vector<double> x_coords;  // Sorted x-coordinates 
 double xmin = 100,xmax = -100,ymin = 100,ymax = -100;
-ofstream out("data.txt");
+
+/**
+ * ResultWriter class
+ * Buffered writer for the results file
+ * Text lines are formatted straight into one reusable buffer (%g prints
+ * doubles exactly like ostream's default) and the buffer is written out
+ * only when full or on close, never per line.
+ * In binary mode the file holds fixed-size records of 32-bit ints and text
+ * lines are dropped.
+ */
+class ResultWriter
+{
+public:
+    bool binary;
+
+    ResultWriter() : binary(false), file(nullptr), used(0), buffer(1 << 20) {}
+    ~ResultWriter() { close(); }
+
+    bool open(const char* path, bool binary_records)
+    {
+        close();
+        binary = binary_records;
+        file = fopen(path, "wb");
+        if (file) setvbuf(file, nullptr, _IONBF, 0);
+        return file != nullptr;
+    }
+
+    /**
+     * Append a printf-formatted text line
+     */
+    void line(const char* fmt, ...)
+    {
+        if (!file || binary) return;
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            va_list args;
+            va_start(args, fmt);
+            size_t room = buffer.size() - used;
+            int len = vsnprintf(buffer.data() + used, room, fmt, args);
+            va_end(args);
+            if (len < 0) return;
+            if ((size_t)len < room)
+            {
+                used += len;
+                return;
+            }
+            flush();
+            if ((size_t)len >= buffer.size()) buffer.resize(len + 1);
+        }
+    }
+
+    /**
+     * Append one binary record of n ints
+     */
+    void record(const int* fields, int n)
+    {
+        if (!file || !binary) return;
+        size_t bytes = n * sizeof(int);
+        if (buffer.size() - used < bytes) flush();
+        memcpy(buffer.data() + used, fields, bytes);
+        used += bytes;
+    }
+
+    void flush()
+    {
+        if (file && used) fwrite(buffer.data(), 1, used, file);
+        used = 0;
+    }
+
+    void close()
+    {
+        flush();
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+private:
+    FILE* file;
+    size_t used;
+    vector<char> buffer;
+};
+ResultWriter out;
 
 /**
  * Point structure representing a point in 2D space.
@@ -32,6 +126,68 @@ struct Point {
     Point(double x = 0, double y = 0) : x(x), y(y) {}
 };
 
+/**
+ * Robust orientation predicate
+ * orient2d() returns the sign of (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x):
+ * +1 if c lies left of (above) the directed line a -> b, -1 if right, 0 if on it.
+ * The determinant is evaluated in double precision and its sign is used when
+ * it clears Shewchuk's error bound ORIENT_BOUND; otherwise orient2dExact()
+ * recomputes it exactly with floating-point expansions
+ */
+const double ORIENT_BOUND = (3.0 + 8.0 * DBL_EPSILON) * (DBL_EPSILON / 2);
+
+// x + y == a + b exactly, x = fl(a + b)
+inline void twoSum(double a, double b, double& x, double& y)
+{
+    x = a + b;
+    double bv = x - a;
+    double av = x - bv;
+    y = (a - av) + (b - bv);
+}
+
+/**
+ * Exact orientation
+ * Expands the determinant into six products, splits each product into two
+ * doubles (fma gives the rounding error) and accumulates them into a
+ * nonoverlapping expansion with zero elimination. The last component has
+ * the largest magnitude, so its sign is the sign of the determinant
+ */
+int orient2dExact(Point a, Point b, Point c)
+{
+    const double terms[6][2] = {{b.x, c.y}, {-b.x, a.y}, {-a.x, c.y}, {-b.y, c.x}, {b.y, a.x}, {a.y, c.x}};
+    double e[12];
+    int m = 0;
+    for (int t = 0; t < 6; t++)
+    {
+        double product = terms[t][0] * terms[t][1];
+        double parts[2] = {fma(terms[t][0], terms[t][1], -product), product};
+        for (double part : parts)
+        {
+            double q = part, h;
+            int k = 0;
+            for (int i = 0; i < m; i++)
+            {
+                twoSum(q, e[i], q, h);
+                if (h != 0) e[k++] = h;
+            }
+            if (q != 0) e[k++] = q;
+            m = k;
+        }
+    }
+    if (m == 0) return 0;
+    return (e[m - 1] > 0) - (e[m - 1] < 0);
+}
+
+inline int orient2d(Point a, Point b, Point c)
+{
+    double det_left = (b.x - a.x) * (c.y - a.y);
+    double det_right = (b.y - a.y) * (c.x - a.x);
+    double det = det_left - det_right;
+    double bound = ORIENT_BOUND * (fabs(det_left) + fabs(det_right));
+    if (det >= bound || -det >= bound) return (det > 0) - (det < 0);
+    return orient2dExact(a, b, c);
+}
+
 /**
  * Segment structure
  * Contains two points (p1, p2) and an ID
@@ -41,25 +197,47 @@ struct Point {
  * getX() returns the x-coordinate of the segment at a given y-coordinate
  * getY() returns the y-coordinate of the segment at a given x-coordinate
  * The segment is represented as a directed line from p1 to p2
+ * slope is precomputed at construction so getY() needs no division or
+ * branch; it is anchored at p1 so getY(p1.x) is exactly p1.y, and a vertical
+ * segment gets slope 0
+ * side() is the exact position of a point: +1 above the segment's line, -1
+ * below, 0 on it; a vertical segment acts like the horizontal line y = p1.y,
+ * as getY() does
  */
 struct Segment {
     Point p1, p2;
     int id;
+    double slope;
+    bool vertical;
     Segment() 
     {
         p1 = Point();
         p2 = Point();
         id = 0;
+        prepare();
     }
     Segment(Point p1, Point p2, int id = 0) 
     {
         this->p1 = p1;
         this->p2 = p2;
         this->id = id;
+        prepare();
+    }
+
+    void prepare()
+    {
+        vertical = (p1.x == p2.x);
+        slope = vertical ? 0 : (p2.y - p1.y) / (p2.x - p1.x);
     }
     bool isAbove(Point p)
     {
-        return ((p2.x - p1.x) * (p.y - p1.y) - (p2.y - p1.y) * (p.x - p1.x)) > 0;
+        return side(p) > 0;
+    }
+
+    int side(Point p)
+    {
+        if (vertical) return (p.y > p1.y) - (p.y < p1.y);
+        return orient2d(p1, p2, p);
     }
 
     double getX(double y)
@@ -70,244 +248,333 @@ struct Segment {
 
     double getY(double x)
     {
-        if (p1.x == p2.x) return p1.y;
-        return p1.y + (p2.y - p1.y) * (x - p1.x) / (p2.x - p1.x);
+        return p1.y + slope * (x - p1.x);
+    }
+
+    /**
+     * Euclidean distance from a point to the closed segment
+     */
+    double distance(Point p)
+    {
+        double dx = p2.x - p1.x, dy = p2.y - p1.y;
+        double len2 = dx * dx + dy * dy;
+        double t = len2 > 0 ? ((p.x - p1.x) * dx + (p.y - p1.y) * dy) / len2 : 0;
+        t = max(0.0, min(1.0, t));
+        return hypot(p.x - p1.x - t * dx, p.y - p1.y - t * dy);
+    }
+
+    /**
+     * Whether the segment meets the closed box [lo, hi], tested exactly:
+     * the bounding boxes overlap and the corners are not all strictly on
+     * one side of the segment's line
+     */
+    bool meetsBox(Point lo, Point hi)
+    {
+        if (p2.x < lo.x || p1.x > hi.x || max(p1.y, p2.y) < lo.y || min(p1.y, p2.y) > hi.y) return false;
+        Point corners[4] = {lo, Point(hi.x, lo.y), hi, Point(lo.x, hi.y)};
+        bool above = false, below = false;
+        for (const Point& c : corners)
+        {
+            int o = orient2d(p1, p2, c);
+            above = above || o >= 0;
+            below = below || o <= 0;
+        }
+        return above && below;
     }
 };
 
-struct PNode;
+/**
+ * Order of two non-crossing segments over the x-range they share
+ * Returns < 0 if a lies below b, > 0 if above, 0 only for a == b
+ * The later left endpoint lies within both x-ranges and is tested exactly
+ * against the other segment; if it touches it (shared endpoint), the earlier
+ * right endpoint decides, and collinear overlaps fall back to the ids.
+ * Unlike comparing getY() values this needs no x and has no rounding
+ */
+int compareSegments(Segment* a, Segment* b)
+{
+    int order = a->p1.x >= b->p1.x ? b->side(a->p1) : -a->side(b->p1);
+    if (order == 0) order = a->p2.x <= b->p2.x ? b->side(a->p2) : -a->side(b->p2);
+    if (order == 0) order = (a->id > b->id) - (a->id < b->id);
+    return order;
+}
+
+// Extra modification slots per tree node. A node has one parent, so any
+// value >= 1 keeps the node-copying structure at O(1) amortized space per update
+const int MOD_SLOTS = 2;
 
+enum NodeField { FIELD_SEGMENT, FIELD_LEFT, FIELD_RIGHT };
+
+struct Node;
+
+/**
+ * Modification slot
+ * New value of one node field from a version on
+ */
+struct Mod {
+    int version;
+    int field;
+    Segment* segment;
+    Node* child;
+};
 
 /**
  * Node structure
- * Contains a segment, timestamp, and pointers to left and right child nodes
+ * Node of the node-copying persistent tree
+ * segment, left and right are the values the node was created with at
+ * version `version`. Later changes are stored in up to MOD_SLOTS slots in
+ * version order; when they are full the tree copies the node instead.
+ * parent is the parent in the newest version only, used to redirect it to
+ * a copy.
  */
 struct Node {
     Segment* segment;
-    int timestamp;
-    PNode *left, *right;
-    Node() 
-    {
-        left = nullptr;
-        right = nullptr;
-        segment = new Segment();
-        timestamp = 0;
-    }
-    Node(Segment* seg,int timestamp) 
+    Node *left, *right;
+    Node* parent;
+    int version;
+    int mod_count;
+    Mod mods[MOD_SLOTS];
+    Node(Segment* seg, int version) 
     {
         segment = seg;
-        this->timestamp = timestamp;
         left = nullptr;
         right = nullptr;
+        parent = nullptr;
+        this->version = version;
+        mod_count = 0;
     }
-    Node(Segment* seg, PNode* left, PNode* right) 
-    {
-        segment = seg;
-        this->timestamp = 0;
-        this->left = left;
-        this->right = right;
-    }
-};
 
-
-/**
- * Persistent node structure
- * Contains a vector of pairs (timestamp, Node*)
- * Each pair represents a version of the tree at a specific timestamp
- */
-struct PNode {
-    vector<pair<int,Node*> > nodes; 
-    PNode() 
+    /**
+     * Fields as seen by a version - O(MOD_SLOTS)
+     * @v: Version, INT_MAX for the newest values
+     */
+    void read(int v, Segment*& seg, Node*& l, Node*& r) const
     {
-        nodes = vector<pair<int,Node*> >();
+        seg = segment;
+        l = left;
+        r = right;
+        for (int i = 0; i < mod_count && mods[i].version <= v; i++)
+        {
+            if (mods[i].field == FIELD_SEGMENT) seg = mods[i].segment;
+            else if (mods[i].field == FIELD_LEFT) l = mods[i].child;
+            else r = mods[i].child;
+        }
     }
 };
 
 /**
  * Persistent tree structure
- * Contains a root node and size
- * Methods to insert segments, delete segments, and find segments above/below a point
+ * Partially persistent BST using node copying (Driscoll et al.)
+ * Only the newest version is modified. A write to a node goes into one of
+ * its modification slots; a full node is copied with its newest values and
+ * its parent is pointed to the copy, which may copy the parent in turn.
+ * The root of every version is kept in roots, so a query finds its root in
+ * O(1) and reads each node on its path in O(MOD_SLOTS). Copies are paid for
+ * by the slots they retire, so the tree takes O(1) amortized space per
+ * update: O(n) overall.
  * createVersion() creates a new version of the tree with given segments
  * findAbove() finds the segment above a point in a specific version
  * findBelow() finds the segment below a point in a specific version
+ * relayout() moves the finished tree into arenas in van Emde Boas order
  */
 class PersistentTree {
 public:
-    PNode* root; // Roots of all versions
+    Node* root;             // root of the newest version
+    vector<Node*> roots;    // roots[v - first_version] = root of version v
+    int first_version;
+    int node_count = 0;
     int size = 0;
+    vector<Node*> allocated;        // every node in creation order, until relayout()
+    vector<Node> node_arena;        // all nodes after relayout()
+    vector<Segment> segment_arena;  // their segments after relayout()
 
     PersistentTree() 
     { 
         root = nullptr; 
+        first_version = 0;
+    }
+
+    /**
+     * Root of a version - O(1)
+     * nullptr for versions before the first one of this tree
+     */
+    Node* rootAt(int version)
+    {
+        int i = version - first_version;
+        if (roots.empty() || i < 0) return nullptr;
+        if (i >= (int)roots.size()) return roots.back();
+        return roots[i];
+    }
+
+    Node* newNode(Segment* seg, int version)
+    {
+        Node* node = new Node(seg, version);
+        node_count++;
+        allocated.push_back(node);
+        return node;
+    }
+
+    static void setOriginal(Node* node, int field, Segment* seg, Node* child)
+    {
+        if (field == FIELD_SEGMENT) node->segment = seg;
+        else if (field == FIELD_LEFT) node->left = child;
+        else node->right = child;
+    }
+
+    /**
+     * Write one field of a node in a version
+     * @node: Node in the newest version
+     * @field: FIELD_SEGMENT, FIELD_LEFT or FIELD_RIGHT
+     * @seg, @child: New value (the one matching the field)
+     * Returns the node holding the newest values afterwards, node itself or
+     * its copy
+     */
+    Node* write(Node* node, int field, Segment* seg, Node* child, int version)
+    {
+        Node* target = node;
+        int slot = node->mod_count - 1;
+        while (slot >= 0 && node->mods[slot].version == version && node->mods[slot].field != field)
+            slot--;
+        if (node->version == version)
+        {
+            setOriginal(node, field, seg, child);
+        }
+        else if (slot >= 0 && node->mods[slot].version == version)
+        {
+            node->mods[slot].segment = seg;
+            node->mods[slot].child = child;
+        }
+        else if (node->mod_count < MOD_SLOTS)
+        {
+            Mod& mod = node->mods[node->mod_count++];
+            mod.version = version;
+            mod.field = field;
+            mod.segment = seg;
+            mod.child = child;
+        }
+        else
+        {
+            // slots full: copy the newest values and redirect the parent
+            Node* copy = newNode(nullptr, version);
+            node->read(INT_MAX, copy->segment, copy->left, copy->right);
+            setOriginal(copy, field, seg, child);
+            if (copy->left) copy->left->parent = copy;
+            if (copy->right) copy->right->parent = copy;
+            replaceChild(node->parent, node, copy, version);
+            target = copy;
+        }
+        if (field != FIELD_SEGMENT && child != nullptr)
+            child->parent = target;
+        return target;
+    }
+
+    /**
+     * Point the parent of old_child (or the root) to child in a version
+     */
+    void replaceChild(Node* parent, Node* old_child, Node* child, int version)
+    {
+        if (parent == nullptr)
+        {
+            root = child;
+            if (child) child->parent = nullptr;
+            return;
+        }
+        Segment* s;
+        Node *l, *r;
+        parent->read(INT_MAX, s, l, r);
+        write(parent, l == old_child ? FIELD_LEFT : FIELD_RIGHT, nullptr, child, version);
+    }
+
+    /**
+     * Record the root of a finished version
+     * Versions are closed in increasing order; the first one closed becomes
+     * first_version
+     */
+    void closeVersion(int version)
+    {
+        if (roots.empty()) first_version = version;
+        roots.resize(version - first_version + 1, root);
+        roots.back() = root;
     }
     
     /**
      * Insert segment into the tree
-     * Creates a new version of the tree with the segment
+     * Adds the segment as a new leaf in the given version
      * @seg: Segment to be inserted
      * @timestamp: Timestamp of the version
      * This function traverses the tree to find the correct position for the segment   
      */
     void insert(Segment* seg,int timestamp) 
     {
-        PNode* curr = root;
         if(root == nullptr)
         {
-            root = new PNode();
-            Node* new_node = new Node(seg,timestamp);
-            root->nodes.push_back(make_pair(timestamp, new_node));
-            return;
-        }
-        if(root->nodes.back().second==nullptr)
-        {
-            root->nodes.push_back(make_pair(timestamp, new Node(seg,timestamp)));
+            root = newNode(seg, timestamp);
             return;
         }
         
-        double y_coord = seg->getY(x_coords[timestamp+1]);
-        // cout<<y_coord<<endl;
-        while(curr != nullptr)
+        Node* curr = root;
+        while(true)
         {
-            int size = (curr->nodes).size();
-            Node* node = curr->nodes.back().second;
-            double ycurr = node->segment->getY(x_coords[timestamp+1]);
-            if(timestamp==1)
-            {
-                // cout<<"[Y] "<<ycurr<<" "<<y_coord<<endl;
-            }
-            if(y_coord < ycurr)
+            Segment* s;
+            Node *l, *r;
+            curr->read(INT_MAX, s, l, r);
+            bool go_left = compareSegments(seg, s) < 0;
+            Node* next = go_left ? l : r;
+            if(next == nullptr)
             {
-                if(node->left == nullptr)
-                {
-                    Node* new_node = new Node(*node);
-                    new_node->timestamp = timestamp;
-                    PNode* new_pnode = new PNode();
-                    new_pnode->nodes.push_back(make_pair(timestamp, new Node(seg,timestamp)));
-                    new_node->left = new_pnode;
-                    curr->nodes.push_back(make_pair(timestamp, new_node));
-                    //cout<<timestamp<<endl;
-                    return;
-                }
-                else
-                    curr = node->left;
+                Node* leaf = newNode(seg, timestamp);
+                write(curr, go_left ? FIELD_LEFT : FIELD_RIGHT, nullptr, leaf, timestamp);
+                return;
             }
-            else
-            {
-                if(node->right == nullptr)
-                {
-                    Node* new_node = new Node(*node);
-                    new_node->timestamp = timestamp;
-                    PNode* new_pnode = new PNode();
-                    new_pnode->nodes.push_back(make_pair(timestamp, new Node(seg,timestamp)));
-                    new_node->right = new_pnode;
-                    curr->nodes.push_back(make_pair(timestamp, new_node));
-                    // cout<<"right add"<<endl;
-                    // cout<<timestamp<<endl;
-                    return;
-                }
-                else
-                    curr = node->right;
-            }    
+            curr = next;
         }
     }
 
     /**
      * Delete segment from the tree
-     * Creates a new version of the tree without the segment
+     * Removes the segment in the given version
      * @seg: Segment to be deleted
      * @timestamp: Timestamp of the version
      * This function traverses the tree to find the segment and remove it
-     * It handles different cases based on the structure of the tree
+     * A node with two children takes the segment of its predecessor, which
+     * is unlinked instead
      */
     void delSegment(Segment* seg,int timestamp)
     {
-        PNode* curr = root;
-        PNode* prev = nullptr;
-        double y_coord = seg->getY(x_coords[timestamp]);
-        while(curr != nullptr && curr->nodes.back().second->segment->id != seg->id)
+        Node* curr = root;
+        Node* prev = nullptr;
+        Segment* s = nullptr;
+        Node *l = nullptr, *r = nullptr;
+        while(curr != nullptr)
         {
+            curr->read(INT_MAX, s, l, r);
+            if (s->id == seg->id) break;
             prev = curr;
-            Node* node = curr->nodes.back().second;
-            double ycurr = node->segment->getY(x_coords[timestamp]);
-            
-            if(y_coord < ycurr)
-                curr = node->left;
-            else
-                curr = node->right;
-            
+            curr = compareSegments(seg, s) < 0 ? l : r;
         }
         if(curr == nullptr)
             return;
-        Node* node = curr->nodes.back().second;
-        if(node->left == nullptr && node->right == nullptr)
-        {
-            if(prev == nullptr)
-            {
-                curr->nodes.push_back(make_pair(timestamp, nullptr));
-                return;
-            }
-            Node* new_node = new Node(*(prev->nodes.back().second));;
-            new_node->timestamp = timestamp;
-            if( new_node->left!=nullptr && new_node->left->nodes.back().second == node )
-                new_node->left = nullptr;
-            else
-                new_node->right = nullptr;
-            prev->nodes.push_back(make_pair(timestamp, new_node));
-            //cout<<"hi"<<endl;
-            return;
-        }
-        else if(node->left == nullptr)
+        if(l == nullptr || r == nullptr)
         {
-            if(prev == nullptr)
-            {
-                curr->nodes.push_back(make_pair(timestamp, curr->nodes.back().second->right->nodes.back().second));
-                return;
-            }
-            Node* new_node = new Node(*(prev->nodes.back().second));
-            new_node->timestamp = timestamp;
-            new_node->left = node->right;
-            prev->nodes.push_back(make_pair(timestamp, new_node));
+            replaceChild(prev, curr, l ? l : r, timestamp);
             return;
         }
-        else if(node->right == nullptr)
+        Node* pred = l;
+        Node* prev1 = nullptr;
+        Segment* ps;
+        Node *pl, *pr;
+        pred->read(INT_MAX, ps, pl, pr);
+        while(pr != nullptr)
         {
-            if(prev == nullptr)
-            {
-                curr->nodes.push_back(make_pair(timestamp, curr->nodes.back().second->left->nodes.back().second));
-                return;
-            }
-            Node* new_node = new Node(*(prev->nodes.back().second));
-            new_node->timestamp = timestamp;
-            new_node->right = node->left;
-            prev->nodes.push_back(make_pair(timestamp, new_node));
-            return;
+            prev1 = pred;
+            pred = pr;
+            pred->read(INT_MAX, ps, pl, pr);
         }
+        curr = write(curr, FIELD_SEGMENT, ps, nullptr, timestamp);
+        if(prev1 == nullptr)
+            write(curr, FIELD_LEFT, nullptr, pl, timestamp);
         else
-        {
-            PNode* pred = node->left;
-            PNode* prev1 = nullptr;
-            while(pred->nodes.back().second->right != nullptr)
-            {
-                prev1 = pred;
-                pred = pred->nodes.back().second->right;
-            }
-            Node* new_node = new Node(*node);
-            new_node->timestamp = timestamp;
-            new_node->segment = pred->nodes.back().second->segment;            
-            if(prev1 == nullptr)
-            {
-                new_node->left = nullptr;
-            }
-            else
-            {
-                Node* new_node1 = new Node(*(prev1->nodes.back().second));
-                new_node1->timestamp = timestamp;
-                new_node1->right = pred->nodes.back().second->left;
-                prev1->nodes.push_back(make_pair(timestamp, new_node1));
-            }
-            curr->nodes.push_back(make_pair(timestamp, new_node));
-            return;
-        }
+            write(prev1, FIELD_RIGHT, nullptr, pl, timestamp);
     }
     
     /**
@@ -319,14 +586,14 @@ public:
      * This function creates a new version of the tree by inserting and deleting segments
      */
     void createVersion(vector<Segment> segments,vector<Segment> del_seg,int ts) {
-        for (vector<Segment>::iterator it = del_seg.begin(); it != del_seg.end(); ++it) {
-            Segment* seg = new Segment(*it);
-            delSegment(seg,ts);
-        }
+        // deletion only compares against the segment, so it needs no copy of its own
+        for (vector<Segment>::iterator it = del_seg.begin(); it != del_seg.end(); ++it)
+            delSegment(&*it,ts);
         for (vector<Segment>::iterator it = segments.begin(); it != segments.end(); ++it) {
             Segment* seg = new Segment(*it);
             insert(seg,ts);
         }
+        closeVersion(ts);
     }
     
     /**
@@ -337,27 +604,20 @@ public:
      */
     Segment* findAbove(int version, Point p) 
     {
-        PNode* curr = root;
+        Node* curr = rootAt(version);
         Segment* result = nullptr;
         while(curr != nullptr)
         {
-            int size = curr->nodes.size();
-            auto it = upper_bound(curr->nodes.begin(), curr->nodes.end(),make_pair(version, reinterpret_cast<Node*>(~0ULL)));
-            if (it == curr->nodes.begin()) 
-            {
-                throw runtime_error("No key less than k exists.");
-            }
-            --it;
-            Node* node = it->second;
-            Segment* seg = node->segment;
-            double ycurr = node->segment->getY(p.x);
-            if (p.y <= ycurr) {
+            Segment* seg;
+            Node *l, *r;
+            curr->read(version, seg, l, r);
+            if (seg->side(p) <= 0) {
                 // Point is below or on current segment
-                result = node->segment;
-                curr = node->left;
+                result = seg;
+                curr = l;
             } else {
                 // Point is above current segment
-                curr = node->right;
+                curr = r;
 
             }
         }
@@ -372,152 +632,1905 @@ public:
      */
     Segment* findBelow(int version, Point p) 
     {
-        PNode* curr = root;
+        Node* curr = rootAt(version);
         Segment* result = nullptr;
         while(curr != nullptr)
         {
-            int size = curr->nodes.size();
-            auto it = upper_bound(curr->nodes.begin(), curr->nodes.end(),make_pair(version, reinterpret_cast<Node*>(~0ULL)));
-            if (it == curr->nodes.begin()) 
-            {
-                throw runtime_error("No key less than k exists.");
-            }
-            --it;
-            Node* node = it->second;
-            Segment* seg = node->segment;
-            double ycurr = node->segment->getY(p.x);
-            if (p.y < ycurr) 
+            Segment* seg;
+            Node *l, *r;
+            curr->read(version, seg, l, r);
+            if (seg->side(p) < 0) 
             {
-                curr = node->left;
+                curr = l;
             } else {
                 // Point is above current segment
-                result = node->segment;
-                curr = node->right;
+                result = seg;
+                curr = r;
 
             }
         }
         return result;
     }
-};
-
-/**
- * Comparator functions for sorting segments
- * compareByP1() sorts segments by their starting point (p1)
- * compareByP2() sorts segments by their ending point (p2)
- */
-bool compareByP1(const Segment& a, const Segment& b) 
-{
-    if (a.p1.x != b.p1.x)
-        return a.p1.x < b.p1.x;
-    return a.p1.y < b.p1.y;
-}
-
-bool compareByP2(const Segment& a, const Segment& b) 
-{
-    if (a.p2.x != b.p2.x)
-        return a.p2.x < b.p2.x;
-    return a.p2.y < b.p2.y;
-}
 
-/**
- * PointLocation class
- * Contains a persistent tree and methods to locate segments above/below a point
- * locate() method finds the segment above and below a given point
- * Constructor initializes the persistent tree with segments
- */
-class PointLocation 
-{
-private:
-    PersistentTree* tree;      
-    vector<Segment> start_segments; 
-    vector<Segment> end_segments; 
-    int sc;
-    int ec;
-    
-public:
     /**
-     * Constructor for PointLocation
-     * Initializes the persistent tree with segments
-     * @segments: Vector of segments to be added to the tree
-     * This function sorts the segments and creates versions of the tree
-     * It handles the insertion and deletion of segments based on their starting and ending points
-     * It also creates slabs based on the x-coordinates of the segments
-     * The slabs are used to determine the active segments in the tree
-     * The constructor also initializes the x-coordinates vector
-     * It removes duplicates and sorts the segments based on their starting and ending points
+     * Van Emde Boas order of a version's tree, cut to a height
+     * @node: Root of the piece
+     * @height: Levels of the piece; the top height / 2 levels come first,
+     *          then every subtree hanging below them, each laid out the same way
+     * @emit: Called on every node of the piece in layout order
+     * Any prefix of the order that fits a cache line, a page or a cache keeps
+     * whole subtrees together, whatever their size
      */
-    PointLocation(vector<Segment>& segments) 
+    template <class Emit>
+    void vebOrder(int version, Node* node, int height, Emit& emit)
     {
-        tree = new PersistentTree();
-        sc = 0;
-        ec = 0;
-        start_segments = segments;
-        end_segments = segments;
-       for (vector<Segment>::const_iterator it = segments.begin(); it != segments.end(); ++it) 
-       {
-            Segment seg = *it;
-            x_coords.push_back(seg.p1.x);
-            x_coords.push_back(seg.p2.x);
+        if (height == 1)
+        {
+            emit(node);
+            return;
         }
-        
-        // Sort and remove duplicates
-        sort(x_coords.begin(), x_coords.end());x_coords.erase(unique(x_coords.begin(), x_coords.end()), x_coords.end());
-        sort(start_segments.begin(), start_segments.end(), compareByP1);
-        sort(end_segments.begin(), end_segments.end(), compareByP2);
-
-        // For each slab, determine active segments
-        for (int i = 0; i < x_coords.size(); i++) 
+        int top = height / 2;
+        vebOrder(version, node, top, emit);
+        // roots of the bottom subtrees, left to right
+        vector<pair<Node*,int> > pending(1, make_pair(node, 0));
+        vector<Node*> bottoms;
+        while (!pending.empty())
         {
-            double slab_left = x_coords[i];
-            vector<Segment> add_segments;
-            while(sc < start_segments.size() && start_segments[sc].p1.x == slab_left) {
-                add_segments.push_back(start_segments[sc]);
-                // cou
-                sc++;
-            }
-            vector<Segment> remove_segments;
-            while(ec < end_segments.size() && end_segments[ec].p2.x == slab_left) {
-                remove_segments.push_back(end_segments[ec]);
-                ec++;
+            Node* curr = pending.back().first;
+            int depth = pending.back().second;
+            pending.pop_back();
+            if (depth == top)
+            {
+                bottoms.push_back(curr);
+                continue;
             }
-            tree->createVersion(add_segments, remove_segments,i);
+            Segment* seg;
+            Node *l, *r;
+            curr->read(version, seg, l, r);
+            if (r) pending.push_back(make_pair(r, depth + 1));
+            if (l) pending.push_back(make_pair(l, depth + 1));
         }
+        for (Node* bottom : bottoms) vebOrder(version, bottom, height - top, emit);
     }
-    
-    // Locate point - O(log² n)
+
     /**
-     * Locate method
-     * Finds the segment above and below a given point
-     * @p: Point to be located
-     * This function first finds the slab containing the point
-     * Then it searches for the segments above and below the point
-     * It returns a pair of segments (above, below)
-     * It also prints the left and right boundaries of the slab
-     * The function handles edge cases where the point is outside the bounds of the segments
+     * Relayout the finished tree for queries - O(n log h) for height h
+     * Nodes are shared between versions, so each gets one place: the first
+     * time a laid-out version reaches it. Versions are laid out in van Emde
+     * Boas order at checkpoints, whenever the nodes created since the last
+     * one reach an eighth of that version's tree, which keeps the total work
+     * linear. The nodes created since the previous checkpoint that it does
+     * not reach follow in creation order, next to the nodes of their time.
+     * Nodes move into node_arena and segments into segment_arena in order
+     * of first use; pointers into the old ones (held outside the tree) are
+     * invalid afterwards. The tree must not be updated afterwards.
      */
-    pair<Segment*,Segment*> locate(const Point& p)
+    void relayout()
     {
-        // Find slab containing point - O(log n)
-        int slab = upper_bound(x_coords.begin(), x_coords.end(), p.x)-x_coords.begin();
-        if(slab==0) 
+        if (allocated.empty() || roots.empty()) return;
+        unordered_map<Node*, int> slot;
+        slot.reserve(allocated.size());
+        vector<Node*> order;
+        order.reserve(allocated.size());
+        auto emit = [&](Node* node)
         {
-            out<<"Left "<<-100<<endl;
-            out<<"Right "<<x_coords[slab]<<endl;
-            return make_pair(nullptr, nullptr);
-        }
-        else if(slab==x_coords.size()) 
+            if (slot.emplace(node, (int)order.size()).second) order.push_back(node);
+        };
+        size_t created = 0, checkpoint = 0;
+        long long last_size = 0;
+        int last_version = first_version + roots.size() - 1;
+        for (int v = first_version; v <= last_version; v++)
         {
-            out<<"Left "<<x_coords[slab-1]<<endl;
-            out<<"Right "<<100<<endl;
-            return make_pair(nullptr, nullptr);
+            while (created < allocated.size() && allocated[created]->version <= v) created++;
+            if ((long long)(created - checkpoint) * 8 < last_size && v < last_version) continue;
+            Node* start = rootAt(v);
+            // height of the version's tree
+            int height = 0;
+            vector<pair<Node*,int> > pending;
+            if (start) pending.push_back(make_pair(start, 1));
+            last_size = 0;
+            while (!pending.empty())
+            {
+                Node* curr = pending.back().first;
+                int depth = pending.back().second;
+                pending.pop_back();
+                height = max(height, depth);
+                last_size++;
+                Segment* seg;
+                Node *l, *r;
+                curr->read(v, seg, l, r);
+                if (l) pending.push_back(make_pair(l, depth + 1));
+                if (r) pending.push_back(make_pair(r, depth + 1));
+            }
+            if (start) vebOrder(v, start, height, emit);
+            for (; checkpoint < created; checkpoint++) emit(allocated[checkpoint]);
+        }
+        for (; checkpoint < allocated.size(); checkpoint++) emit(allocated[checkpoint]);
+
+        unordered_map<Segment*, Segment*> moved;
+        vector<Segment*> old_segments;
+        auto see = [&](Segment* seg)
+        {
+            if (seg && moved.emplace(seg, nullptr).second) old_segments.push_back(seg);
+        };
+        for (Node* node : order)
+        {
+            see(node->segment);
+            for (int k = 0; k < node->mod_count; k++)
+                if (node->mods[k].field == FIELD_SEGMENT) see(node->mods[k].segment);
+        }
+        segment_arena.clear();
+        segment_arena.reserve(old_segments.size());
+        for (Segment* seg : old_segments)
+        {
+            segment_arena.push_back(*seg);
+            moved[seg] = &segment_arena.back();
+        }
+
+        node_arena.clear();
+        node_arena.reserve(order.size());
+        for (Node* node : order) node_arena.push_back(*node);
+        auto to = [&](Node* node) -> Node* { return node ? &node_arena[slot[node]] : nullptr; };
+        for (Node& node : node_arena)
+        {
+            node.segment = node.segment ? moved[node.segment] : nullptr;
+            node.left = to(node.left);
+            node.right = to(node.right);
+            node.parent = to(node.parent);
+            for (int k = 0; k < node.mod_count; k++)
+            {
+                if (node.mods[k].field == FIELD_SEGMENT) node.mods[k].segment = moved[node.mods[k].segment];
+                else node.mods[k].child = to(node.mods[k].child);
+            }
+        }
+        for (Node*& r : roots) r = to(r);
+        root = to(root);
+        for (Node* node : order) delete node;
+        for (Segment* seg : old_segments) delete seg;
+        vector<Node*>().swap(allocated);
+    }
+
+    /**
+     * Free the nodes of all versions and the segments they hold
+     * The tree is empty afterwards. Segments are shared between a node and
+     * its copies, so each one is freed once
+     */
+    void release()
+    {
+        unordered_set<Segment*> segments;
+        for (Node* node : allocated)
+        {
+            if (node->segment) segments.insert(node->segment);
+            for (int k = 0; k < node->mod_count; k++)
+                if (node->mods[k].field == FIELD_SEGMENT && node->mods[k].segment) segments.insert(node->mods[k].segment);
+        }
+        for (Segment* seg : segments) delete seg;
+        for (Node* node : allocated) delete node;
+        vector<Node*>().swap(allocated);
+        vector<Node>().swap(node_arena);
+        vector<Segment>().swap(segment_arena);
+        roots.clear();
+        root = nullptr;
+        node_count = size = 0;
+    }
+
+    /**
+     * Visit the segments of a version that may come within a radius of a point
+     * @version: Version of the tree
+     * @p: Query point
+     * @x0, x1: Part of the slab to consider, within the version's slab
+     * @visit: Called on each candidate segment; returns the current radius,
+     *         which may shrink as closer segments are found
+     * The version's segments do not cross over the slab, so a segment lying
+     * entirely above p.y + radius on [x0, x1] has every segment of its right
+     * subtree above it too, and symmetrically below. The child on p's side is
+     * visited first so the radius shrinks early
+     */
+    template <class Visit>
+    void visitNear(int version, const Point& p, double x0, double x1, Visit visit)
+    {
+        vector<Node*> pending;
+        if (Node* start = rootAt(version)) pending.push_back(start);
+        while (!pending.empty())
+        {
+            Node* curr = pending.back();
+            pending.pop_back();
+            Segment* seg;
+            Node *l, *r;
+            curr->read(version, seg, l, r);
+            double radius = visit(seg);
+            double y0 = seg->getY(x0), y1 = seg->getY(x1);
+            bool below = l && max(y0, y1) >= p.y - radius;
+            bool above = r && min(y0, y1) <= p.y + radius;
+            bool p_above = seg->side(p) > 0;
+            if (p_above && below) pending.push_back(l);
+            if (above) pending.push_back(r);
+            if (!p_above && below) pending.push_back(l);
+        }
+    }
+
+    /**
+     * Visit the segments of a version that lie in a run of its y-order
+     * @version: Version of the tree
+     * @from: Predicate true from the first segment of the run upwards
+     * @to: Predicate true up to the last segment of the run
+     * @visit: Called on each segment of the run
+     * Both predicates must be monotone in the y-order of the version, e.g.
+     * comparisons of the y at a fixed x. Takes O(log n) plus the run length
+     */
+    template <class From, class To, class Visit>
+    void visitRun(int version, From from, To to, Visit visit)
+    {
+        vector<Node*> pending;
+        if (Node* start = rootAt(version)) pending.push_back(start);
+        while (!pending.empty())
+        {
+            Node* curr = pending.back();
+            pending.pop_back();
+            Segment* seg;
+            Node *l, *r;
+            curr->read(version, seg, l, r);
+            bool after_start = from(seg), before_end = to(seg);
+            if (after_start && before_end) visit(seg);
+            if (l && after_start) pending.push_back(l);
+            if (r && before_end) pending.push_back(r);
+        }
+    }
+};
+
+// GCC 12's AVX-512 intrinsics use self-initialized "undefined" registers internally
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/**
+ * FlatTree structure
+ * Pointer-free copy of the finished persistent trees for batched queries
+ * Every Node becomes a (node_seg, node_left, node_right) triple of indices
+ * followed by MOD_SLOTS (mod_ts, mod_field, mod_val) slots, unused slots
+ * having mod_ts = INT_MAX. version_root holds the root node of every
+ * version across all trees. Segments are stored as (x0, y0, x1, y1)
+ * endpoint arrays. Missing children and empty versions are -1.
+ * findBatch() walks 8 queries in lockstep with AVX-512 gathers, or 4 with
+ * AVX2, applying the modification slots and the orientation test for all
+ * lanes at once
+ */
+struct FlatTree {
+    vector<int> node_seg, node_left, node_right;
+    vector<int> mod_ts, mod_field, mod_val;
+    vector<int> version_root;
+    vector<double> x0, y0, x1, y1;
+    vector<Segment*> segs;
+
+    /**
+     * Build the flattened copy
+     * @trees: Persistent trees, trees[c] holding versions from tree_start[c] on
+     * @versions: Number of versions (slabs)
+     */
+    void build(const vector<PersistentTree*>& trees, const vector<int>& tree_start, int versions)
+    {
+        node_seg.clear(); node_left.clear(); node_right.clear();
+        mod_ts.clear(); mod_field.clear(); mod_val.clear(); version_root.clear();
+        x0.clear(); y0.clear(); x1.clear(); y1.clear(); segs.clear();
+
+        unordered_map<Node*, int> node_id;
+        unordered_map<Segment*, int> seg_id;
+        vector<Node*> nodes;
+        auto nodeOf = [&](Node* node) -> int
+        {
+            if (node == nullptr) return -1;
+            auto it = node_id.find(node);
+            if (it != node_id.end()) return it->second;
+            node_id[node] = nodes.size();
+            nodes.push_back(node);
+            return nodes.size() - 1;
+        };
+        auto segOf = [&](Segment* seg) -> int
+        {
+            auto it = seg_id.find(seg);
+            if (it != seg_id.end()) return it->second;
+            seg_id[seg] = segs.size();
+            segs.push_back(seg);
+            return segs.size() - 1;
+        };
+        for (int v = 0, c = 0; v < versions && !trees.empty(); v++)
+        {
+            while (c + 1 < (int)trees.size() && tree_start[c + 1] <= v) c++;
+            version_root.push_back(nodeOf(trees[c]->rootAt(v)));
+        }
+        // BFS over nodes; children and segments are numbered on first sight
+        for (int i = 0; i < (int)nodes.size(); i++)
+        {
+            Node* node = nodes[i];
+            node_seg.push_back(segOf(node->segment));
+            node_left.push_back(nodeOf(node->left));
+            node_right.push_back(nodeOf(node->right));
+            for (int k = 0; k < MOD_SLOTS; k++)
+            {
+                if (k >= node->mod_count)
+                {
+                    mod_ts.push_back(INT_MAX);
+                    mod_field.push_back(FIELD_SEGMENT);
+                    mod_val.push_back(-1);
+                    continue;
+                }
+                const Mod& mod = node->mods[k];
+                mod_ts.push_back(mod.version);
+                mod_field.push_back(mod.field);
+                mod_val.push_back(mod.field == FIELD_SEGMENT ? segOf(mod.segment) : nodeOf(mod.child));
+            }
+        }
+        for (Segment* seg : segs)
+        {
+            x0.push_back(seg->p1.x);
+            y0.push_back(seg->p1.y);
+            x1.push_back(seg->p2.x);
+            y1.push_back(seg->p2.y);
+        }
+    }
+
+    /**
+     * Scalar walk of one query, same decisions as findAbove/findBelow
+     * @above: true for findAbove semantics, false for findBelow
+     * Returns the segment index or -1
+     */
+    int findScalar(int version, Point p, bool above) const
+    {
+        int result = -1;
+        int curr = version_root[version];
+        while (curr != -1)
+        {
+            int s = node_seg[curr], l = node_left[curr], r = node_right[curr];
+            for (int k = curr * MOD_SLOTS; k < (curr + 1) * MOD_SLOTS && mod_ts[k] <= version; k++)
+            {
+                if (mod_field[k] == FIELD_SEGMENT) s = mod_val[k];
+                else if (mod_field[k] == FIELD_LEFT) l = mod_val[k];
+                else r = mod_val[k];
+            }
+            int side = orient2d(Point(x0[s], y0[s]), Point(x1[s], y1[s]), p);
+            bool go_left = above ? side <= 0 : side < 0;
+            if (go_left == above) result = s;
+            curr = go_left ? l : r;
+        }
+        return result;
+    }
+
+    /**
+     * Batched findAbove/findBelow
+     * @versions: Tree version per query (negative means no slab, result -1)
+     * @pts: Query points
+     * @n: Number of queries
+     * @above: true for findAbove semantics, false for findBelow
+     * @out: Output segment index per query, -1 if none
+     */
+    void findBatch(const int* versions, const Point* pts, int n, bool above, int* out) const
+    {
+        int i = 0;
+        if (!node_seg.empty() && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+            i = findBatchAvx512(versions, pts, n, above, out);
+        else if (!node_seg.empty() && __builtin_cpu_supports("avx2"))
+            i = findBatchAvx2(versions, pts, n, above, out);
+        for (; i < n; i++)
+            out[i] = versions[i] < 0 ? -1 : findScalar(versions[i], pts[i], above);
+    }
+
+    /**
+     * Name of the kernel findBatch() runs on this CPU
+     */
+    static const char* kernelName()
+    {
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) return "avx512 x8";
+        if (__builtin_cpu_supports("avx2")) return "avx2 x4";
+        return "scalar";
+    }
+
+    /**
+     * Narrow a 4 x 64-bit lane mask to 4 x 32-bit lanes
+     */
+    __attribute__((target("avx2")))
+    static __m128i narrowMask(__m256d mask)
+    {
+        __m256 m = _mm256_castpd_ps(mask);
+        return _mm_castps_si128(_mm_shuffle_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1), _MM_SHUFFLE(2, 0, 2, 0)));
+    }
+
+    /**
+     * AVX2 kernel over groups of 4 queries, returns the number handled
+     * The same walk as findBatchAvx512() with 4 double lanes: the 32-bit
+     * node indices and masks live in 128-bit registers and are widened to
+     * 64 bits for the coordinate gathers
+     */
+    __attribute__((target("avx2")))
+    int findBatchAvx2(const int* versions, const Point* pts, int n, bool above, int* out) const
+    {
+        const __m128i none = _mm_set1_epi32(-1);
+        const __m128i slots = _mm_set1_epi32(MOD_SLOTS);
+        const __m128i xy = _mm_setr_epi32(0, 2, 4, 6);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        const __m256d bound_scale = _mm256_set1_pd(ORIENT_BOUND);
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            const double* p = reinterpret_cast<const double*>(pts + i);
+            __m256d px = _mm256_i32gather_pd(p, xy, 8);
+            __m256d py = _mm256_i32gather_pd(p + 1, xy, 8);
+            __m128i version = _mm_loadu_si128(reinterpret_cast<const __m128i*>(versions + i));
+            __m128i result = none;
+            __m128i retry = _mm_setzero_si128();
+            __m128i active = _mm_cmpgt_epi32(version, none);
+            __m128i curr = _mm_mask_i32gather_epi32(none, version_root.data(), version, active, 4);
+            active = _mm_and_si128(active, _mm_cmpgt_epi32(curr, none));
+            while (!_mm_testz_si128(active, active))
+            {
+                __m128i s = _mm_mask_i32gather_epi32(_mm_setzero_si128(), node_seg.data(), curr, active, 4);
+                __m128i l = _mm_mask_i32gather_epi32(none, node_left.data(), curr, active, 4);
+                __m128i r = _mm_mask_i32gather_epi32(none, node_right.data(), curr, active, 4);
+                __m128i slot = _mm_mullo_epi32(curr, slots);
+                for (int k = 0; k < MOD_SLOTS; k++, slot = _mm_add_epi32(slot, _mm_set1_epi32(1)))
+                {
+                    __m128i ts = _mm_mask_i32gather_epi32(none, mod_ts.data(), slot, active, 4);
+                    __m128i apply = _mm_andnot_si128(_mm_cmpgt_epi32(ts, version), active);
+                    __m128i field = _mm_mask_i32gather_epi32(none, mod_field.data(), slot, apply, 4);
+                    __m128i val = _mm_mask_i32gather_epi32(_mm_setzero_si128(), mod_val.data(), slot, apply, 4);
+                    s = _mm_blendv_epi8(s, val, _mm_cmpeq_epi32(field, _mm_set1_epi32(FIELD_SEGMENT)));
+                    l = _mm_blendv_epi8(l, val, _mm_cmpeq_epi32(field, _mm_set1_epi32(FIELD_LEFT)));
+                    r = _mm_blendv_epi8(r, val, _mm_cmpeq_epi32(field, _mm_set1_epi32(FIELD_RIGHT)));
+                }
+
+                __m256d wide = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(active));
+                __m256d ax = _mm256_mask_i32gather_pd(zero, x0.data(), s, wide, 8);
+                __m256d ay = _mm256_mask_i32gather_pd(zero, y0.data(), s, wide, 8);
+                __m256d bx = _mm256_mask_i32gather_pd(zero, x1.data(), s, wide, 8);
+                __m256d by = _mm256_mask_i32gather_pd(zero, y1.data(), s, wide, 8);
+                __m256d det_left = _mm256_mul_pd(_mm256_sub_pd(bx, ax), _mm256_sub_pd(py, ay));
+                __m256d det_right = _mm256_mul_pd(_mm256_sub_pd(by, ay), _mm256_sub_pd(px, ax));
+                __m256d det = _mm256_sub_pd(det_left, det_right);
+                __m256d bound = _mm256_mul_pd(bound_scale, _mm256_add_pd(_mm256_andnot_pd(sign, det_left),
+                                                                         _mm256_andnot_pd(sign, det_right)));
+                __m128i sure = narrowMask(_mm256_or_pd(_mm256_cmp_pd(det, bound, _CMP_GE_OQ),
+                                                       _mm256_cmp_pd(_mm256_sub_pd(zero, det), bound, _CMP_GE_OQ)));
+                retry = _mm_or_si128(retry, _mm_andnot_si128(sure, active));
+                active = _mm_and_si128(active, sure);
+
+                __m128i go_left = narrowMask(above ? _mm256_cmp_pd(det, zero, _CMP_LE_OQ)
+                                                   : _mm256_cmp_pd(det, zero, _CMP_LT_OQ));
+                __m128i take = above ? _mm_and_si128(active, go_left) : _mm_andnot_si128(go_left, active);
+                result = _mm_blendv_epi8(result, s, take);
+                curr = _mm_blendv_epi8(curr, _mm_blendv_epi8(r, l, go_left), active);
+                active = _mm_and_si128(active, _mm_cmpgt_epi32(curr, none));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), result);
+            for (unsigned lanes = _mm_movemask_ps(_mm_castsi128_ps(retry)); lanes; lanes &= lanes - 1)
+            {
+                int k = __builtin_ctz(lanes);
+                out[i + k] = findScalar(versions[i + k], pts[i + k], above);
+            }
+        }
+        return i;
+    }
+
+    /**
+     * AVX-512 kernel over groups of 8 queries, returns the number handled
+     * Every level gathers the node's original fields and its MOD_SLOTS
+     * slots and applies the slots up to each lane's version with masks.
+     * The orientation determinant is filtered with ORIENT_BOUND; a lane that
+     * does not clear it leaves the kernel and is redone by findScalar()
+     */
+    __attribute__((target("avx512f,avx512vl")))
+    int findBatchAvx512(const int* versions, const Point* pts, int n, bool above, int* out) const
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i none = _mm256_set1_epi32(-1);
+        const __m256i slots = _mm256_set1_epi32(MOD_SLOTS);
+        const __m256i xy = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+        const __m512d bound_scale = _mm512_set1_pd(ORIENT_BOUND);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            const double* p = reinterpret_cast<const double*>(pts + i);
+            __m512d px = _mm512_i32gather_pd(xy, p, 8);
+            __m512d py = _mm512_i32gather_pd(xy, p + 1, 8);
+            __m256i version = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(versions + i));
+            __m256i result = none;
+            __mmask8 retry = 0;
+            __mmask8 active = _mm256_cmpge_epi32_mask(version, zero);
+            __m256i curr = _mm256_mmask_i32gather_epi32(none, active, version, version_root.data(), 4);
+            active &= _mm256_cmpge_epi32_mask(curr, zero);
+            while (active)
+            {
+                __m256i s = _mm256_mmask_i32gather_epi32(zero, active, curr, node_seg.data(), 4);
+                __m256i l = _mm256_mmask_i32gather_epi32(none, active, curr, node_left.data(), 4);
+                __m256i r = _mm256_mmask_i32gather_epi32(none, active, curr, node_right.data(), 4);
+                __m256i slot = _mm256_mullo_epi32(curr, slots);
+                for (int k = 0; k < MOD_SLOTS; k++, slot = _mm256_add_epi32(slot, _mm256_set1_epi32(1)))
+                {
+                    __m256i ts = _mm256_mmask_i32gather_epi32(none, active, slot, mod_ts.data(), 4);
+                    __mmask8 apply = active & _mm256_cmple_epi32_mask(ts, version);
+                    __m256i field = _mm256_mmask_i32gather_epi32(zero, apply, slot, mod_field.data(), 4);
+                    __m256i val = _mm256_mmask_i32gather_epi32(zero, apply, slot, mod_val.data(), 4);
+                    s = _mm256_mask_blend_epi32(apply & _mm256_cmpeq_epi32_mask(field, _mm256_set1_epi32(FIELD_SEGMENT)), s, val);
+                    l = _mm256_mask_blend_epi32(apply & _mm256_cmpeq_epi32_mask(field, _mm256_set1_epi32(FIELD_LEFT)), l, val);
+                    r = _mm256_mask_blend_epi32(apply & _mm256_cmpeq_epi32_mask(field, _mm256_set1_epi32(FIELD_RIGHT)), r, val);
+                }
+
+                __m512d ax = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), active, s, x0.data(), 8);
+                __m512d ay = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), active, s, y0.data(), 8);
+                __m512d bx = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), active, s, x1.data(), 8);
+                __m512d by = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), active, s, y1.data(), 8);
+                __m512d det_left = _mm512_mul_pd(_mm512_sub_pd(bx, ax), _mm512_sub_pd(py, ay));
+                __m512d det_right = _mm512_mul_pd(_mm512_sub_pd(by, ay), _mm512_sub_pd(px, ax));
+                __m512d det = _mm512_sub_pd(det_left, det_right);
+                __m512d bound = _mm512_mul_pd(bound_scale, _mm512_add_pd(_mm512_abs_pd(det_left), _mm512_abs_pd(det_right)));
+                __mmask8 sure = _mm512_cmp_pd_mask(det, bound, _CMP_GE_OQ) |
+                                _mm512_cmp_pd_mask(_mm512_sub_pd(_mm512_setzero_pd(), det), bound, _CMP_GE_OQ);
+                retry |= active & ~sure;
+                active &= sure;
+
+                __mmask8 go_left = above ? _mm512_cmp_pd_mask(det, _mm512_setzero_pd(), _CMP_LE_OQ)
+                                         : _mm512_cmp_pd_mask(det, _mm512_setzero_pd(), _CMP_LT_OQ);
+                result = _mm256_mask_blend_epi32(active & (above ? go_left : (__mmask8)~go_left), result, s);
+                curr = _mm256_mask_blend_epi32(active, curr, _mm256_mask_blend_epi32(go_left, r, l));
+                active &= _mm256_cmpge_epi32_mask(curr, zero);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), result);
+            for (unsigned lanes = retry; lanes; lanes &= lanes - 1)
+            {
+                int k = __builtin_ctz(lanes);
+                out[i + k] = findScalar(versions[i + k], pts[i + k], above);
+            }
+        }
+        return i;
+    }
+};
+#pragma GCC diagnostic pop
+
+/**
+ * Comparator functions for sorting segments
+ * compareByP1() sorts segments by their starting point (p1)
+ * compareByP2() sorts segments by their ending point (p2)
+ */
+bool compareByP1(const Segment& a, const Segment& b) 
+{
+    if (a.p1.x != b.p1.x)
+        return a.p1.x < b.p1.x;
+    return a.p1.y < b.p1.y;
+}
+
+bool compareByP2(const Segment& a, const Segment& b) 
+{
+    if (a.p2.x != b.p2.x)
+        return a.p2.x < b.p2.x;
+    return a.p2.y < b.p2.y;
+}
+
+/**
+ * Parallel sort
+ * Sorts equal runs of the vector in separate threads, then merges
+ * neighbouring runs pairwise (each round in parallel) until one run is left
+ * @v: Vector to sort
+ * @comp: Strict weak ordering
+ * @threads: Number of threads, 1 falls back to std::sort
+ */
+template <class T, class Compare>
+void parallelSort(vector<T>& v, Compare comp, int threads)
+{
+    int parts = min<long long>(threads, v.size() / 4096 + 1);
+    if (parts <= 1)
+    {
+        sort(v.begin(), v.end(), comp);
+        return;
+    }
+    vector<size_t> bounds(parts + 1);
+    for (int p = 0; p <= parts; p++) bounds[p] = v.size() * p / parts;
+    vector<thread> workers;
+    for (int p = 0; p < parts; p++)
+        workers.emplace_back([&v, &bounds, comp, p]() { sort(v.begin() + bounds[p], v.begin() + bounds[p + 1], comp); });
+    for (auto& w : workers) w.join();
+    for (int width = 1; width < parts; width *= 2)
+    {
+        workers.clear();
+        for (int p = 0; p + width < parts; p += 2 * width)
+        {
+            size_t lo = bounds[p], mid = bounds[p + width], hi = bounds[min(p + 2 * width, parts)];
+            workers.emplace_back([&v, comp, lo, mid, hi]() { inplace_merge(v.begin() + lo, v.begin() + mid, v.begin() + hi, comp); });
+        }
+        for (auto& w : workers) w.join();
+    }
+}
+
+/**
+ * Lexicographic order of points, the order in which the crossing sweep
+ * visits them (a vertical line is swept from bottom to top)
+ */
+bool lexLess(const Point& a, const Point& b)
+{
+    return a.x != b.x ? a.x < b.x : a.y < b.y;
+}
+
+/**
+ * CrossingSweep class
+ * Bentley–Ottmann sweep that splits crossing segments at their intersection
+ * points, so the pieces meet only at shared endpoints as PointLocation
+ * expects. Runs in O((n + k) log n) for k intersections.
+ * The status holds the live piece of every segment cut by the sweep line,
+ * ordered by y at the current event point; a vertical segment sits at the
+ * event's y, so it is ordered like the sheared segments of the trees.
+ * Intersections are tested exactly with orient2d(), and an endpoint lying
+ * inside another segment splits that segment too. Intersection points are
+ * rounded to doubles. Collinear overlaps are left as they are.
+ * Every piece keeps the id of its input segment
+ */
+class CrossingSweep
+{
+private:
+    struct StatusOrder {
+        CrossingSweep* sweep;
+        bool operator()(int i, int j) const { return sweep->below(i, j); }
+    };
+    struct Piece {
+        Point left, right;
+        int id;
+        int next;        // piece continuing this one after a split, -1 if none
+        double slope;    // +inf for a vertical piece
+        set<int, StatusOrder>::iterator pos;
+    };
+    enum EventKind { EVENT_END, EVENT_CROSS, EVENT_START };
+    struct Event {
+        Point p;
+        int kind;
+        int a, b;
+        bool operator>(const Event& e) const
+        {
+            if (p.x != e.p.x) return p.x > e.p.x;
+            if (p.y != e.p.y) return p.y > e.p.y;
+            return kind > e.kind;
+        }
+    };
+
+    vector<Piece> pieces;
+    vector<Segment> result;
+    Point sweep;
+    set<int, StatusOrder> status;
+    priority_queue<Event, vector<Event>, greater<Event> > events;
+
+    /**
+     * Y of a piece on the vertical line through the sweep point
+     */
+    double yAtSweep(const Piece& s)
+    {
+        if (s.left.x == s.right.x) return min(max(sweep.y, s.left.y), s.right.y);
+        if (sweep.x == s.left.x) return s.left.y;
+        if (sweep.x == s.right.x) return s.right.y;
+        return s.left.y + s.slope * (sweep.x - s.left.x);
+    }
+
+    /**
+     * Status order: by y at the sweep line; pieces through one point are
+     * ordered as just right of it once the sweep has reached the point, and
+     * as just left of it before
+     */
+    bool below(int i, int j)
+    {
+        const Piece& a = pieces[i];
+        const Piece& b = pieces[j];
+        double ya = yAtSweep(a), yb = yAtSweep(b);
+        if (ya != yb) return ya < yb;
+        if (a.slope != b.slope) return ya <= sweep.y ? a.slope < b.slope : a.slope > b.slope;
+        if (a.id != b.id) return a.id < b.id;
+        return i < j;
+    }
+
+    /**
+     * Follow the splits of a piece to the one containing p
+     */
+    int liveAt(int i, const Point& p)
+    {
+        while (pieces[i].next >= 0 && !lexLess(p, pieces[i].right)) i = pieces[i].next;
+        return i;
+    }
+
+    int addPiece(Point left, Point right, int id)
+    {
+        Piece s;
+        s.left = left;
+        s.right = right;
+        s.id = id;
+        s.next = -1;
+        s.slope = left.x == right.x ? HUGE_VAL : (right.y - left.y) / (right.x - left.x);
+        pieces.push_back(s);
+        return pieces.size() - 1;
+    }
+
+    /**
+     * Queue the intersection of two neighbouring pieces, if any
+     */
+    void check(int i, int j)
+    {
+        if (i < 0 || j < 0) return;
+        const Piece& a = pieces[i];
+        const Piece& b = pieces[j];
+        int o1 = orient2d(a.left, a.right, b.left), o2 = orient2d(a.left, a.right, b.right);
+        int o3 = orient2d(b.left, b.right, a.left), o4 = orient2d(b.left, b.right, a.right);
+        Point p;
+        if (o1 * o2 < 0 && o3 * o4 < 0)
+        {
+            double dax = a.right.x - a.left.x, day = a.right.y - a.left.y;
+            double dbx = b.right.x - b.left.x, dby = b.right.y - b.left.y;
+            double t = ((b.left.x - a.left.x) * dby - (b.left.y - a.left.y) * dbx) / (dax * dby - day * dbx);
+            p = Point(a.left.x + t * dax, a.left.y + t * day);
+            // keep the rounded point inside both bounding boxes
+            p.x = min(max(p.x, max(a.left.x, b.left.x)), min(a.right.x, b.right.x));
+            p.y = min(max(p.y, max(min(a.left.y, a.right.y), min(b.left.y, b.right.y))),
+                      min(max(a.left.y, a.right.y), max(b.left.y, b.right.y)));
+        }
+        else if (o1 == 0 && o2 != 0 && lexLess(a.left, b.left) && lexLess(b.left, a.right)) p = b.left;
+        else if (o2 == 0 && o1 != 0 && lexLess(a.left, b.right) && lexLess(b.right, a.right)) p = b.right;
+        else if (o3 == 0 && o4 != 0 && lexLess(b.left, a.left) && lexLess(a.left, b.right)) p = a.left;
+        else if (o4 == 0 && o3 != 0 && lexLess(b.left, a.right) && lexLess(a.right, b.right)) p = a.right;
+        else return;
+        if (lexLess(p, sweep)) p = sweep;
+        events.push(Event{p, EVENT_CROSS, i, j});
+    }
+
+    int neighbour(int i, bool above)
+    {
+        auto it = pieces[i].pos;
+        if (above) return ++it == status.end() ? -1 : *it;
+        return it == status.begin() ? -1 : *--it;
+    }
+
+    void insert(int i)
+    {
+        pieces[i].pos = status.insert(i).first;
+        check(neighbour(i, false), i);
+        check(i, neighbour(i, true));
+    }
+
+    /**
+     * Split the pieces of a crossing at the sweep point
+     * All pieces are cut before any continuation is inserted: a continuation
+     * checked against a piece not yet cut would see a crossing again just
+     * right of the rounded point. Pieces that already start at the point form
+     * one run with the continuations, and the run's outer neighbours are checked
+     */
+    void split(vector<int>& cut)
+    {
+        vector<int> added;
+        for (int i : cut)
+        {
+            Piece& s = pieces[i];
+            if (s.next >= 0 || !lexLess(s.left, sweep) || !lexLess(sweep, s.right)) continue;
+            status.erase(s.pos);
+            result.push_back(Segment(s.left, sweep, s.id));
+            int j = addPiece(sweep, pieces[i].right, pieces[i].id);
+            pieces[i].right = sweep;
+            pieces[i].next = j;
+            added.push_back(j);
+        }
+        splits += added.size();
+        for (int j : added) pieces[j].pos = status.insert(j).first;
+        // the pieces starting here are consecutive; only the two outside pairs are new
+        auto starts_here = [&](int k) { return k >= 0 && pieces[k].left.x == sweep.x && pieces[k].left.y == sweep.y; };
+        for (int j : added)
+        {
+            int lo = j, hi = j;
+            while (starts_here(neighbour(lo, false))) lo = neighbour(lo, false);
+            while (starts_here(neighbour(hi, true))) hi = neighbour(hi, true);
+            check(neighbour(lo, false), lo);
+            check(hi, neighbour(hi, true));
+        }
+    }
+
+public:
+    long long splits;  // pieces cut off at an intersection
+
+    CrossingSweep() : status(StatusOrder{this}), splits(0) {}
+
+    /**
+     * Split the segments at all their intersections
+     * @segments: Segments with p1 lexicographically before p2
+     * Returns the pieces, each with the id of its input segment
+     */
+    vector<Segment> run(const vector<Segment>& segments)
+    {
+        for (const Segment& seg : segments)
+        {
+            // a single point crosses nothing, and its end would come before its start
+            if (seg.p1.x == seg.p2.x && seg.p1.y == seg.p2.y)
+            {
+                result.push_back(seg);
+                continue;
+            }
+            int i = addPiece(seg.p1, seg.p2, seg.id);
+            events.push(Event{seg.p1, EVENT_START, i, -1});
+            events.push(Event{seg.p2, EVENT_END, i, -1});
+        }
+        while (!events.empty())
+        {
+            Event e = events.top();
+            events.pop();
+            sweep = e.p;
+            if (e.kind == EVENT_START) insert(e.a);
+            else if (e.kind == EVENT_END)
+            {
+                int i = liveAt(e.a, e.p);
+                int lo = neighbour(i, false), hi = neighbour(i, true);
+                status.erase(pieces[i].pos);
+                result.push_back(Segment(pieces[i].left, pieces[i].right, pieces[i].id));
+                check(lo, hi);
+            }
+            else
+            {
+                // every crossing at this point is cut at once
+                vector<int> cut(1, liveAt(e.a, e.p));
+                cut.push_back(liveAt(e.b, e.p));
+                while (!events.empty() && events.top().kind == EVENT_CROSS
+                       && events.top().p.x == e.p.x && events.top().p.y == e.p.y)
+                {
+                    cut.push_back(liveAt(events.top().a, e.p));
+                    cut.push_back(liveAt(events.top().b, e.p));
+                    events.pop();
+                }
+                split(cut);
+            }
+        }
+        return result;
+    }
+};
+
+const int MAX_SPLIT_PASSES = 4;
+
+/**
+ * Split crossing segments at their intersections, see CrossingSweep
+ * @splits: If set, receives the number of splits made
+ * A rounded cut point can leave two short pieces crossing by an ulp, so
+ * the sweep is repeated on its pieces until a pass splits nothing (at most
+ * MAX_SPLIT_PASSES passes; the second pass is usually the last)
+ */
+vector<Segment> splitCrossings(const vector<Segment>& segments, long long* splits = nullptr)
+{
+    vector<Segment> pieces = segments;
+    long long total = 0;
+    for (int pass = 0; pass < MAX_SPLIT_PASSES; pass++)
+    {
+        CrossingSweep sweep;
+        pieces = sweep.run(pieces);
+        total += sweep.splits;
+        if (sweep.splits == 0) break;
+    }
+    if (splits) *splits = total;
+    return pieces;
+}
+
+/**
+ * PointLocation class
+ * Contains a persistent tree and methods to locate segments above/below a point
+ * locate() method finds the segment above and below a given point
+ * Constructor initializes the persistent tree with segments
+ * A parallel build splits the versions into consecutive x-ranges, each with
+ * its own persistent tree; trees[c] answers versions from tree_start[c] on
+ */
+class PointLocation 
+{
+private:
+    vector<PersistentTree*> trees;
+    vector<int> tree_start;
+    vector<Segment> start_segments; 
+    vector<int> end_order;     // indices into start_segments ordered by p2
+    vector<Segment*> verticals;  // vertical segments by (x, lower y), kept out of the trees
+    vector<int> bucket_start;  // bucket_start[b] = first index of x_coords falling in bucket b or later
+    double bucket_min;
+    double bucket_scale;
+    FlatTree flat;             // flattened tree for locateBatch, filled by freeze()
+    vector<int> face_above;    // face just above each segment by id, filled by labelFaces()
+
+    /**
+     * Bucket key of an x-coordinate
+     * Quantizes x over [xmin_coord, xmax_coord] and clamps to the table, so the
+     * key is monotone in x and both x_coords and queries share the same rounding
+     */
+    int bucketOf(double x)
+    {
+        double k = (x - bucket_min) * bucket_scale;
+        int buckets = bucket_start.size() - 1;
+        if (!(k > 0)) return 0;
+        if (k >= buckets) return buckets - 1;
+        return (int)k;
+    }
+
+    /**
+     * Vertical segment through a point
+     * Returns the vertical segment containing p, or nullptr. Verticals have
+     * no width, so they never hold a slab; the trees answer a point on a slab
+     * boundary as if it were shifted right by an infinitesimal, and only a
+     * point lying on a vertical segment sees it
+     */
+    Segment* onVertical(const Point& p)
+    {
+        if (verticals.empty()) return nullptr;
+        auto it = lower_bound(verticals.begin(), verticals.end(), p, [](Segment* s, const Point& q) {
+            return s->p1.x != q.x ? s->p1.x < q.x : s->p2.y < q.y;
+        });
+        if (it == verticals.end() || (*it)->p1.x != p.x || (*it)->p1.y > p.y) return nullptr;
+        return *it;
+    }
+
+    /**
+     * Tree holding a given version
+     */
+    int treeOf(int version)
+    {
+        return upper_bound(tree_start.begin(), tree_start.end(), version) - tree_start.begin() - 1;
+    }
+
+    /**
+     * Build the versions [from, to) into one tree
+     * @tree: Empty tree to fill
+     * @from: First version (index into x_coords)
+     * @to: One past the last version
+     * A tree that does not start at version 0 is first seeded with the
+     * segments crossing x_coords[from], inserted median-first so the seed is
+     * balanced. Segments ending exactly at x_coords[from] are then already gone
+     */
+    void buildVersions(PersistentTree* tree, int from, int to)
+    {
+        double x_from = x_coords[from];
+        int sc = lower_bound(start_segments.begin(), start_segments.end(), x_from,
+                             [](const Segment& s, double x) { return s.p1.x < x; }) - start_segments.begin();
+        int ec = lower_bound(end_order.begin(), end_order.end(), x_from,
+                             [this](int s, double x) { return start_segments[s].p2.x < x; }) - end_order.begin();
+        if (from > 0)
+        {
+            vector<Segment> crossing;
+            for (int i = 0; i < sc; i++)
+                if (start_segments[i].p2.x > x_from)
+                    crossing.push_back(start_segments[i]);
+            sort(crossing.begin(), crossing.end(), [](Segment& a, Segment& b) {
+                return compareSegments(&a, &b) < 0;
+            });
+            // median-first insertion order
+            vector<pair<int,int> > ranges(1, make_pair(0, (int)crossing.size()));
+            for (int r = 0; r < (int)ranges.size(); r++)
+            {
+                int lo = ranges[r].first, hi = ranges[r].second;
+                if (lo >= hi) continue;
+                int mid = (lo + hi) / 2;
+                tree->insert(new Segment(crossing[mid]), from);
+                ranges.push_back(make_pair(lo, mid));
+                ranges.push_back(make_pair(mid + 1, hi));
+            }
+            while (ec < (int)end_order.size() && start_segments[end_order[ec]].p2.x == x_from)
+                ec++;
+        }
+
+        // For each slab, determine active segments
+        for (int i = from; i < to; i++) 
+        {
+            double slab_left = x_coords[i];
+            vector<Segment> add_segments;
+            while(sc < (int)start_segments.size() && start_segments[sc].p1.x == slab_left) {
+                add_segments.push_back(start_segments[sc]);
+                sc++;
+            }
+            vector<Segment> remove_segments;
+            while(ec < (int)end_order.size() && start_segments[end_order[ec]].p2.x == slab_left) {
+                remove_segments.push_back(start_segments[end_order[ec]]);
+                ec++;
+            }
+            tree->createVersion(add_segments, remove_segments,i);
+        }
+    }
+    
+public:
+    /**
+     * Constructor for PointLocation
+     * Initializes the persistent tree with segments
+     * @segments: Vector of segments to be added to the tree
+     * This function sorts the segments and creates versions of the tree
+     * It handles the insertion and deletion of segments based on their starting and ending points
+     * It also creates slabs based on the x-coordinates of the segments
+     * The slabs are used to determine the active segments in the tree
+     * The constructor also initializes the x-coordinates vector
+     * It removes duplicates and sorts the segments based on their starting and ending points
+     * @threads: With more than one thread the sorts run in parallel and the
+     *           versions are built as that many independent x-ranges
+     */
+    PointLocation(vector<Segment>& segments, int threads = 1) 
+    {
+        bucket_min = 0;
+        bucket_scale = 0;
+        x_coords.clear();
+       for (vector<Segment>::const_iterator it = segments.begin(); it != segments.end(); ++it) 
+       {
+            Segment seg = *it;
+            if (seg.vertical)
+            {
+                verticals.push_back(new Segment(seg));
+                continue;
+            }
+            start_segments.push_back(seg);
+            x_coords.push_back(seg.p1.x);
+            x_coords.push_back(seg.p2.x);
+        }
+        sort(verticals.begin(), verticals.end(), [](Segment* a, Segment* b) {
+            return a->p1.x != b->p1.x ? a->p1.x < b->p1.x : a->p1.y < b->p1.y;
+        });
+        
+        // Sort and remove duplicates
+        parallelSort(x_coords, less<double>(), threads);
+        x_coords.erase(unique(x_coords.begin(), x_coords.end()), x_coords.end());
+        parallelSort(start_segments, compareByP1, threads);
+        end_order.resize(start_segments.size());
+        iota(end_order.begin(), end_order.end(), 0);
+        parallelSort(end_order, [this](int a, int b) {
+            return compareByP2(start_segments[a], start_segments[b]);
+        }, threads);
+
+        int chunks = max(1, min<int>(threads, x_coords.size()));
+        for (int c = 0; c < chunks; c++)
+        {
+            trees.push_back(new PersistentTree());
+            tree_start.push_back((long long)x_coords.size() * c / chunks);
+        }
+        if (chunks == 1)
+        {
+            if (!x_coords.empty()) buildVersions(trees[0], 0, x_coords.size());
+            return;
+        }
+        vector<thread> workers;
+        for (int c = 0; c < chunks; c++)
+        {
+            int to = c + 1 < chunks ? tree_start[c + 1] : x_coords.size();
+            workers.emplace_back([this, c, to]() { buildVersions(trees[c], tree_start[c], to); });
+        }
+        for (auto& w : workers) w.join();
+    }
+    
+    /**
+     * Build the x-bucket table in front of the slab search
+     * @buckets: Number of equal-width buckets over the x-range of the slabs
+     * Each bucket stores the first x_coords index whose key is at least the bucket,
+     * so a query only binary searches the x_coords falling in its own bucket.
+     * Memory is (buckets + 1) ints; on uniform data a query touches O(1) slabs
+     */
+    void buildBuckets(int buckets)
+    {
+        bucket_start.clear();
+        if (buckets <= 0 || x_coords.empty()) return;
+        bucket_min = x_coords.front();
+        double width = x_coords.back() - x_coords.front();
+        bucket_scale = width > 0 ? buckets / width : 0;
+        bucket_start.assign(buckets + 1, 0);
+        int b = 0;
+        for (int i = 0; i < (int)x_coords.size(); i++)
+        {
+            int key = bucketOf(x_coords[i]);
+            while (b <= key) bucket_start[b++] = i;
+        }
+        while (b <= buckets) bucket_start[b++] = x_coords.size();
+    }
+
+    /**
+     * Find slab containing an x-coordinate
+     * @x: x-coordinate of the query
+     * Returns the number of x_coords that are <= x, i.e. upper_bound over x_coords.
+     * With a bucket table only the x_coords sharing the query's bucket are searched
+     */
+    int findSlab(double x)
+    {
+        if (bucket_start.empty())
+            return upper_bound(x_coords.begin(), x_coords.end(), x) - x_coords.begin();
+        int b = bucketOf(x);
+        return upper_bound(x_coords.begin() + bucket_start[b], x_coords.begin() + bucket_start[b + 1], x) - x_coords.begin();
+    }
+
+    /**
+     * Flatten the finished tree for locateBatch
+     */
+    void freeze()
+    {
+        flat.build(trees, tree_start, x_coords.size());
+    }
+
+    /**
+     * Relayout the finished trees in van Emde Boas order
+     * Segment pointers returned before are invalid afterwards; a frozen
+     * copy is rebuilt on the moved segments
+     */
+    void relayout()
+    {
+        for (PersistentTree* tree : trees) tree->relayout();
+        if (!flat.node_seg.empty()) freeze();
+    }
+
+    /**
+     * Free the trees and the vertical segments
+     * A's query path leaves them to the end of the process; callers
+     * building many structures, such as the benchmarks, free each one.
+     * Nothing may be queried afterwards
+     */
+    void release()
+    {
+        for (PersistentTree* tree : trees)
+        {
+            tree->release();
+            delete tree;
+        }
+        for (Segment* seg : verticals) delete seg;
+        trees.clear();
+        tree_start.clear();
+        verticals.clear();
+    }
+
+    /**
+     * Number of tree nodes allocated, copies included
+     */
+    long long nodeCount()
+    {
+        long long count = 0;
+        for (PersistentTree* tree : trees) count += tree->node_count;
+        return count;
+    }
+
+    /**
+     * Bytes held by the structure
+     * Counts the tree nodes, the input copies and the sorted orders, one
+     * tree segment per input segment (the build copies each one when it is
+     * inserted) and the frozen copy if any
+     */
+    size_t bytes()
+    {
+        size_t total = nodeCount() * sizeof(Node) + x_coords.capacity() * sizeof(double);
+        total += start_segments.capacity() * sizeof(Segment) + end_order.capacity() * sizeof(int);
+        total += start_segments.size() * sizeof(Segment) + verticals.size() * (sizeof(Segment) + sizeof(Segment*));
+        total += bucket_start.capacity() * sizeof(int);
+        total += (flat.node_seg.capacity() + flat.node_left.capacity() + flat.node_right.capacity()) * sizeof(int);
+        total += (flat.mod_ts.capacity() + flat.mod_field.capacity() + flat.mod_val.capacity()) * sizeof(int);
+        total += flat.version_root.capacity() * sizeof(int) + flat.segs.capacity() * sizeof(Segment*);
+        total += (flat.x0.capacity() + flat.y0.capacity() + flat.x1.capacity() + flat.y1.capacity()) * sizeof(double);
+        return total;
+    }
+
+    /**
+     * Label the faces of the subdivision
+     * Segments are assumed to meet only at shared endpoints, so everything
+     * just above (or below) one segment is a single face. Each segment has
+     * an upper side 2 * id and a lower side 2 * id + 1, plus one element for
+     * the outer face, and the faces are the classes of sides under:
+     * - a sweep over x_coords: two segments that become neighbours in the
+     *   active set see one face between them (none below or above = outer)
+     * - around a shared endpoint, consecutive segments in angular order
+     *   bound one wedge, which joins the side of one with the side of the next
+     * A vertical segment has no slab; its left side counts as its upper one.
+     * Returns the number of faces, the outer face being 0
+     */
+    int labelFaces()
+    {
+        vector<Segment*> all;
+        for (Segment& seg : start_segments) all.push_back(&seg);
+        all.insert(all.end(), verticals.begin(), verticals.end());
+        int ids = 0;
+        for (Segment* seg : all) ids = max(ids, seg->id + 1);
+        const int outer = 2 * ids;
+        vector<int> parent(outer + 1);
+        iota(parent.begin(), parent.end(), 0);
+        auto find = [&](int a) {
+            while (parent[a] != a) a = parent[a] = parent[parent[a]];
+            return a;
+        };
+        auto join = [&](int a, int b) { parent[find(a)] = find(b); };
+        auto up = [&](Segment* seg) { return seg ? 2 * seg->id : outer; };
+        auto down = [&](Segment* seg) { return seg ? 2 * seg->id + 1 : outer; };
+
+        // active set ordered bottom to top; points compare by side()
+        struct Order {
+            using is_transparent = void;
+            bool operator()(Segment* a, Segment* b) const { return compareSegments(a, b) < 0; }
+            bool operator()(Segment* a, const Point& p) const { return a->side(p) > 0; }
+            bool operator()(const Point& p, Segment* a) const { return a->side(p) < 0; }
+        };
+        set<Segment*, Order> active;
+        auto neighbours = [&](set<Segment*, Order>::iterator it, Segment*& below, Segment*& above) {
+            below = it == active.begin() ? nullptr : *prev(it);
+            above = it == active.end() ? nullptr : *it;
+        };
+        size_t sc = 0, ec = 0;
+        for (double x : x_coords)
+        {
+            vector<Point> gaps;
+            for (; ec < end_order.size() && start_segments[end_order[ec]].p2.x == x; ec++)
+            {
+                active.erase(&start_segments[end_order[ec]]);
+                gaps.push_back(start_segments[end_order[ec]].p2);
+            }
+            vector<Segment*> added;
+            for (; sc < start_segments.size() && start_segments[sc].p1.x == x; sc++)
+                added.push_back(*active.insert(&start_segments[sc]).first);
+            Segment *below, *above;
+            for (const Point& p : gaps)
+            {
+                neighbours(active.lower_bound(p), below, above);
+                join(up(below), down(above));
+            }
+            for (Segment* seg : added)
+            {
+                auto it = active.find(seg);
+                neighbours(it, below, above);
+                join(up(below), down(seg));
+                neighbours(next(it), below, above);
+                join(up(seg), down(above));
+            }
+        }
+
+        // segment ends grouped by point; at_p1 tells which end of the segment it is
+        struct End { Point pt, other; Segment* seg; bool at_p1; };
+        vector<End> ends;
+        for (Segment* seg : all)
+        {
+            ends.push_back({seg->p1, seg->p2, seg, true});
+            ends.push_back({seg->p2, seg->p1, seg, false});
+        }
+        sort(ends.begin(), ends.end(), [](const End& a, const End& b) {
+            return a.pt.x != b.pt.x ? a.pt.x < b.pt.x : a.pt.y < b.pt.y;
+        });
+        for (size_t i = 0, j; i < ends.size(); i = j)
+        {
+            for (j = i + 1; j < ends.size() && ends[j].pt.x == ends[i].pt.x && ends[j].pt.y == ends[i].pt.y; j++);
+            Point p = ends[i].pt;
+            // counterclockwise from the positive x axis, exactly
+            auto upper = [&](const End& e) { return e.other.y > p.y || (e.other.y == p.y && e.other.x > p.x); };
+            sort(ends.begin() + i, ends.begin() + j, [&](const End& a, const End& b) {
+                if (upper(a) != upper(b)) return upper(a);
+                return orient2d(p, a.other, b.other) > 0;
+            });
+            // the wedge counterclockwise of a segment leaving p is on its left:
+            // above it when p is its p1, below it otherwise
+            for (size_t k = i; k < j; k++)
+            {
+                const End& from = ends[k];
+                const End& to = ends[k + 1 < j ? k + 1 : i];
+                join(from.at_p1 ? up(from.seg) : down(from.seg), to.at_p1 ? down(to.seg) : up(to.seg));
+            }
+        }
+
+        vector<int> label(outer + 1, -1);
+        int faces = 0;
+        label[find(outer)] = faces++;
+        face_above.assign(ids, -1);
+        for (Segment* seg : all)
+        {
+            int root = find(up(seg));
+            if (label[root] < 0) label[root] = faces++;
+            face_above[seg->id] = label[root];
+        }
+        return faces;
+    }
+
+    /**
+     * Face of a located point, after labelFaces()
+     * @located: (above, below) as returned by locate() or locateBatch()
+     * The point lies in the face just above its lower segment, or in the
+     * outer face without one; a point on a vertical gets its left face
+     */
+    int faceOf(const pair<Segment*,Segment*>& located)
+    {
+        return located.second ? face_above[located.second->id] : 0;
+    }
+
+    /**
+     * Batched locate without output
+     * @pts: Query points
+     * @result: Output (above, below) per point, nullptr where locate() has none
+     * @simd: Use the lockstep kernel on the frozen tree instead of one
+     *        findAbove/findBelow walk per point
+     */
+    void locateBatch(const vector<Point>& pts, vector<pair<Segment*,Segment*> >& result, bool simd)
+    {
+        int n = pts.size();
+        vector<int> versions(n);
+        for (int i = 0; i < n; i++)
+        {
+            int slab = findSlab(pts[i].x);
+            versions[i] = (slab == 0 || slab == (int)x_coords.size()) ? -1 : slab - 1;
+            if (versions[i] >= 0 && simd && flat.version_root[versions[i]] < 0) versions[i] = -1;
+        }
+        result.assign(n, make_pair((Segment*)nullptr, (Segment*)nullptr));
+        if (!simd)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if (versions[i] < 0) continue;
+                PersistentTree* tree = trees[treeOf(versions[i])];
+                result[i] = make_pair(tree->findAbove(versions[i], pts[i]), tree->findBelow(versions[i], pts[i]));
+            }
         }
-        out<<"Left "<<x_coords[slab-1]<<endl;
-        out<<"Right "<<x_coords[slab]<<endl; 
+        else
+        {
+            vector<int> above(n), below(n);
+            flat.findBatch(versions.data(), pts.data(), n, true, above.data());
+            flat.findBatch(versions.data(), pts.data(), n, false, below.data());
+            for (int i = 0; i < n; i++)
+            {
+                if (above[i] >= 0) result[i].first = flat.segs[above[i]];
+                if (below[i] >= 0) result[i].second = flat.segs[below[i]];
+            }
+        }
+        for (int i = 0; i < n && !verticals.empty(); i++)
+            if (Segment* vertical = onVertical(pts[i]))
+                result[i] = make_pair(vertical, vertical);
+    }
+
+    // Locate point - O(log² n)
+    /**
+     * Locate method
+     * Finds the segment above and below a given point
+     * @p: Point to be located
+     * This function first finds the slab containing the point
+     * Then it searches for the segments above and below the point
+     * It returns a pair of segments (above, below)
+     * It also prints the left and right boundaries of the slab
+     * The function handles edge cases where the point is outside the bounds of the segments
+     */
+    pair<Segment*,Segment*> locate(const Point& p)
+    {
+        // Find slab containing point - O(log n)
+        int slab = findSlab(p.x);
+        out.line("Left %g\n", slab == 0 ? -100.0 : x_coords[slab-1]);
+        out.line("Right %g\n", slab == (int)x_coords.size() ? 100.0 : x_coords[slab]);
+        // A point on a vertical segment has it both above and below
+        Segment* vertical = onVertical(p);
+        if (vertical != nullptr)
+            return make_pair(vertical, vertical);
+        if (slab == 0 || slab == (int)x_coords.size())
+            return make_pair(nullptr, nullptr);
         // Search in appropriate tree version - O(log n)
+        PersistentTree* tree = trees[treeOf(slab-1)];
         return make_pair(tree->findAbove(slab-1, p), tree->findBelow(slab-1, p));
     }
+
+    /**
+     * Nearest segments to a point
+     * @p: Query point
+     * @k: Number of segments wanted
+     * Returns up to k (distance, segment) pairs by increasing Euclidean
+     * distance, one per input id, so pieces of a split segment count once.
+     * The search starts in p's slab and moves out one slab at a time, always
+     * to the side whose slab is closer in x, until both are farther than the
+     * k-th distance found. Within a slab, visitNear() only walks the part of
+     * the version whose segments can still beat that distance. Vertical
+     * segments are scanned by x within the same distance.
+     * With the k nearest near p this costs O(log n) per slab visited, and
+     * slabs are only visited within that distance
+     */
+    vector<pair<double,Segment*> > nearest(const Point& p, int k)
+    {
+        vector<pair<double,Segment*> > best;
+        auto radius = [&]() {
+            return (int)best.size() < k ? numeric_limits<double>::infinity() : best.back().first;
+        };
+        auto offer = [&](Segment* seg) {
+            double d = seg->distance(p);
+            if (d >= radius()) return radius();
+            auto same = find_if(best.begin(), best.end(), [&](const pair<double,Segment*>& b) {
+                return b.second->id == seg->id;
+            });
+            if (same != best.end())
+            {
+                if (same->first <= d) return radius();
+                best.erase(same);
+            }
+            else if ((int)best.size() == k)
+                best.pop_back();
+            best.insert(upper_bound(best.begin(), best.end(), make_pair(d, seg)), make_pair(d, seg));
+            return radius();
+        };
+        if (k <= 0) return best;
+
+        // version v covers [x_coords[v], x_coords[v + 1]]
+        int versions = max<int>(0, x_coords.size() - 1);
+        int slab = findSlab(p.x);
+        // a query at or right of the last x_coord has slab == versions + 1
+        int left = min(slab - 1, versions - 1), right = max(slab, 0);
+        auto gap = [&](int v) {
+            if (v < 0 || v >= versions) return numeric_limits<double>::infinity();
+            return max(0.0, max(x_coords[v] - p.x, p.x - x_coords[v + 1]));
+        };
+        while (true)
+        {
+            double gap_left = gap(left), gap_right = gap(right);
+            // no version left on either side, or none closer than the k-th
+            if (isinf(gap_left) && isinf(gap_right)) break;
+            if (min(gap_left, gap_right) > radius()) break;
+            int v = gap_left <= gap_right ? left-- : right++;
+            double r = radius();
+            double x0 = max(x_coords[v], p.x - r), x1 = min(x_coords[v + 1], p.x + r);
+            trees[treeOf(v)]->visitNear(v, p, x0, x1, offer);
+        }
+
+        auto it = lower_bound(verticals.begin(), verticals.end(), p.x - radius(), [](Segment* s, double x) {
+            return s->p1.x < x;
+        });
+        for (; it != verticals.end() && (*it)->p1.x <= p.x + radius(); ++it)
+            offer(*it);
+        return best;
+    }
+
+    /**
+     * Segments meeting a window
+     * @lo, hi: Lower left and upper right corners of the closed window
+     * Returns one segment per input id, each tested exactly with meetsBox().
+     * Over the slabs overlapping [lo.x, hi.x], clipped to the window, the
+     * first slab reports the run of its y-order within [lo.y, hi.y]. A later
+     * slab only adds what was not in the window at its left boundary: the
+     * segments starting there, and the two runs that cross the window's
+     * bottom or top edge inside the slab. A segment that runs through the
+     * window is thus met once, not once per slab, and the query takes
+     * O(log n) per slab plus the segments reported. Vertical segments are
+     * scanned by x
+     */
+    vector<Segment*> window(const Point& lo, const Point& hi)
+    {
+        vector<Segment*> found;
+        unordered_set<int> seen;
+        auto take = [&](Segment* seg) {
+            if (seg->meetsBox(lo, hi) && seen.insert(seg->id).second) found.push_back(seg);
+        };
+        int versions = max<int>(0, x_coords.size() - 1);
+        // the slab ending at lo.x still holds the segments ending there
+        int first = max(0, (int)(lower_bound(x_coords.begin(), x_coords.end(), lo.x) - x_coords.begin()) - 1);
+        for (int v = first; v < versions && x_coords[v] <= hi.x; v++)
+        {
+            double x0 = max(x_coords[v], lo.x), x1 = min(x_coords[v + 1], hi.x);
+            PersistentTree* tree = trees[treeOf(v)];
+            if (v == first)
+            {
+                tree->visitRun(v, [&](Segment* s) { return max(s->getY(x0), s->getY(x1)) >= lo.y; },
+                                  [&](Segment* s) { return min(s->getY(x0), s->getY(x1)) <= hi.y; }, take);
+                continue;
+            }
+            // rising through the bottom edge, falling through the top edge
+            tree->visitRun(v, [&](Segment* s) { return s->getY(x1) >= lo.y; },
+                              [&](Segment* s) { return s->getY(x0) < lo.y; }, take);
+            tree->visitRun(v, [&](Segment* s) { return s->getY(x0) > hi.y; },
+                              [&](Segment* s) { return s->getY(x1) <= hi.y; }, take);
+            auto start = lower_bound(start_segments.begin(), start_segments.end(), Point(x_coords[v], lo.y),
+                                     [](const Segment& s, const Point& p) {
+                                         return s.p1.x != p.x ? s.p1.x < p.x : s.p1.y < p.y;
+                                     });
+            for (; start != start_segments.end() && start->p1.x == x_coords[v] && start->p1.y <= hi.y; ++start)
+                take(&*start);
+        }
+        auto it = lower_bound(verticals.begin(), verticals.end(), lo.x, [](Segment* s, double x) {
+            return s->p1.x < x;
+        });
+        for (; it != verticals.end() && (*it)->p1.x <= hi.x; ++it)
+            take(*it);
+        return found;
+    }
+};
+/**
+ * Benchmark of the slab lookup
+ * Times findSlab() over uniformly distributed query x-coordinates with the
+ * plain binary search and with the bucket table, and checks both agree
+ * @pl: Built point location structure
+ * @queries: Number of random queries
+ * @buckets: Size of the bucket table to compare against
+ */
+void benchSlabLookup(PointLocation& pl, int queries, int buckets)
+{
+    mt19937 rng(12345);
+    uniform_real_distribution<double> dist(x_coords.front(), x_coords.back());
+    vector<double> xs(queries);
+    for (int i = 0; i < queries; i++) xs[i] = dist(rng);
+
+    long long sum_plain = 0, sum_bucket = 0;
+    pl.buildBuckets(0);
+    auto t0 = chrono::steady_clock::now();
+    for (int i = 0; i < queries; i++) sum_plain += pl.findSlab(xs[i]);
+    auto t1 = chrono::steady_clock::now();
+    pl.buildBuckets(buckets);
+    auto t2 = chrono::steady_clock::now();
+    for (int i = 0; i < queries; i++) sum_bucket += pl.findSlab(xs[i]);
+    auto t3 = chrono::steady_clock::now();
+
+    double plain_ns = chrono::duration<double, nano>(t1 - t0).count() / queries;
+    double bucket_ns = chrono::duration<double, nano>(t3 - t2).count() / queries;
+    cout << "slabs " << x_coords.size() << ", buckets " << buckets
+         << " (" << (buckets + 1) * sizeof(int) << " bytes)" << endl;
+    cout << "binary search " << plain_ns << " ns/query, bucketed " << bucket_ns << " ns/query"
+         << (sum_plain == sum_bucket ? "" : "  [MISMATCH]") << endl;
+}
+
+/**
+ * Microbenchmark of the y-at-x evaluation done at every tree level
+ * Evaluates random (segment, x) pairs with the division formula used before
+ * the slope was precomputed, and with getY(). As in a tree walk, the
+ * comparison result selects the next pair, so evaluations cannot overlap
+ * @segments: Input segments
+ * @evals: Number of evaluations
+ */
+void benchGetY(vector<Segment>& segments, int evals)
+{
+    mt19937 rng(777);
+    // a small working set keeps the loop compute bound, as in the top tree levels
+    uniform_int_distribution<int> pick(0, min<int>(segments.size(), 512) - 1);
+    vector<int> idx(evals);
+    vector<double> xs(evals);
+    for (int i = 0; i < evals; i++)
+    {
+        idx[i] = pick(rng);
+        const Segment& s = segments[idx[i]];
+        xs[i] = s.p1.x + (s.p2.x - s.p1.x) * (i % 97) / 96.0;
+    }
+    int path_div = 0, path_pre = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (int i = 0, j = 0; i < evals; i++)
+    {
+        int k = (i + j < evals) ? i + j : i;
+        const Segment& s = segments[idx[k]];
+        double y = (s.p1.x == s.p2.x) ? s.p1.y : s.p1.y + (s.p2.y - s.p1.y) * (xs[k] - s.p1.x) / (s.p2.x - s.p1.x);
+        j = y < s.p1.y;
+        path_div += j;
+    }
+    auto t1 = chrono::steady_clock::now();
+    for (int i = 0, j = 0; i < evals; i++)
+    {
+        int k = (i + j < evals) ? i + j : i;
+        Segment& s = segments[idx[k]];
+        j = s.getY(xs[k]) < s.p1.y;
+        path_pre += j;
+    }
+    auto t2 = chrono::steady_clock::now();
+    cout << "getY division " << chrono::duration<double, nano>(t1 - t0).count() / evals
+         << " ns, precomputed " << chrono::duration<double, nano>(t2 - t1).count() / evals
+         << " ns" << (path_div == path_pre ? "" : "  [MISMATCH]") << endl;
+}
+
+/**
+ * Benchmark of batched point location
+ * Times locateBatch() over uniformly distributed points, once with a scalar
+ * findAbove/findBelow walk per point and once with the lockstep kernel
+ * @pl: Built point location structure
+ * @queries: Number of random queries
+ */
+void benchBatchQueries(PointLocation& pl, int queries)
+{
+    mt19937 rng(54321);
+    uniform_real_distribution<double> dx(x_coords.front(), x_coords.back());
+    uniform_real_distribution<double> dy(ymin, ymax);
+    vector<Point> pts(queries);
+    for (int i = 0; i < queries; i++) pts[i] = Point(dx(rng), dy(rng));
+
+    vector<pair<Segment*,Segment*> > scalar, batched;
+    pl.freeze();
+    auto t0 = chrono::steady_clock::now();
+    pl.locateBatch(pts, scalar, false);
+    auto t1 = chrono::steady_clock::now();
+    pl.locateBatch(pts, batched, true);
+    auto t2 = chrono::steady_clock::now();
+
+    bool same = true;
+    for (int i = 0; i < queries; i++)
+        same = same && (scalar[i].first == nullptr) == (batched[i].first == nullptr)
+                    && (scalar[i].second == nullptr) == (batched[i].second == nullptr)
+                    && (scalar[i].first == nullptr || scalar[i].first->id == batched[i].first->id)
+                    && (scalar[i].second == nullptr || scalar[i].second->id == batched[i].second->id);
+    double scalar_ns = chrono::duration<double, nano>(t1 - t0).count() / queries;
+    double batch_ns = chrono::duration<double, nano>(t2 - t1).count() / queries;
+    cout << "scalar locate " << scalar_ns << " ns/query, batched " << FlatTree::kernelName() << " "
+         << batch_ns << " ns/query (" << scalar_ns / batch_ns << "x)" << (same ? "" : "  [MISMATCH]") << endl;
+}
+
+/**
+ * Cache miss counter
+ * Counts read misses of one cache level in this thread with
+ * perf_event_open(); stop() returns -1 where the kernel or a virtual
+ * machine does not expose the hardware counter
+ * @cache: PERF_COUNT_HW_CACHE_L1D or PERF_COUNT_HW_CACHE_LL
+ */
+struct MissCounter {
+    int fd;
+
+    MissCounter(unsigned long long cache)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~MissCounter() { if (fd >= 0) close(fd); }
+
+    void start()
+    {
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    long long stop()
+    {
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        long long count;
+        return read(fd, &count, sizeof(count)) == sizeof(count) ? count : -1;
+    }
 };
-int main() {
+
+/**
+ * Benchmark of the tree layout
+ * Times scalar locateBatch() walks over uniformly distributed points with
+ * the nodes where the build allocated them and after relayout(), counting
+ * L1D and last-level cache read misses where the counters are available,
+ * and checks both layouts give the same segments
+ * @pl: Built point location structure, not yet laid out
+ * @queries: Number of random queries
+ */
+void benchLayout(PointLocation& pl, int queries)
+{
+    mt19937 rng(24680);
+    uniform_real_distribution<double> dx(x_coords.front(), x_coords.back());
+    uniform_real_distribution<double> dy(ymin, ymax);
+    vector<Point> pts(queries);
+    for (int i = 0; i < queries; i++) pts[i] = Point(dx(rng), dy(rng));
+
+    MissCounter l1(PERF_COUNT_HW_CACHE_L1D), llc(PERF_COUNT_HW_CACHE_LL);
+    auto run = [&](const char* name, vector<pair<int,int> >& ids)
+    {
+        vector<pair<Segment*,Segment*> > result;
+        l1.start();
+        llc.start();
+        auto t0 = chrono::steady_clock::now();
+        pl.locateBatch(pts, result, false);
+        auto t1 = chrono::steady_clock::now();
+        long long l1_misses = l1.stop(), llc_misses = llc.stop();
+        for (auto& r : result)
+            ids.push_back(make_pair(r.first ? r.first->id : -1, r.second ? r.second->id : -1));
+        double ns = chrono::duration<double, nano>(t1 - t0).count() / queries;
+        cout << name << ": " << ns << " ns/query";
+        if (l1_misses < 0 || llc_misses < 0) cout << ", cache misses n/a (no hardware counters)";
+        else cout << ", " << (double)l1_misses / queries << " L1D and " << (double)llc_misses / queries << " LLC misses/query";
+        cout << endl;
+        return ns;
+    };
+    vector<pair<int,int> > before, after;
+    double before_ns = run("allocation order", before);
+    auto t0 = chrono::steady_clock::now();
+    pl.relayout();
+    auto t1 = chrono::steady_clock::now();
+    cout << "relayout of " << pl.nodeCount() << " nodes " << chrono::duration<double, milli>(t1 - t0).count() << " ms" << endl;
+    double after_ns = run("van Emde Boas order", after);
+    cout << "speedup " << before_ns / after_ns << "x" << (before == after ? "" : "  [MISMATCH]") << endl;
+}
+
+/**
+ * Benchmark of the nearest-segment query
+ * Times nearest() on random points against a scan over all segments, and
+ * checks both give the same distances
+ * @pl: Built point location structure
+ * @segments: Input segments
+ * @queries: Number of random queries
+ * @k: Segments wanted per query
+ */
+void benchNearest(PointLocation& pl, vector<Segment>& segments, int queries, int k)
+{
+    mt19937 rng(24680);
+    uniform_real_distribution<double> dx(xmin, xmax);
+    uniform_real_distribution<double> dy(ymin, ymax);
+    vector<Point> pts(queries);
+    for (int i = 0; i < queries; i++) pts[i] = Point(dx(rng), dy(rng));
+    // left of, at and right of the first and last slab boundaries
+    if (!x_coords.empty())
+        for (double x : {x_coords.front() - 1, x_coords.front(), x_coords.back(), x_coords.back() + 1})
+            pts.push_back(Point(x, dy(rng)));
+    queries = pts.size();
+
+    vector<vector<double> > tree_dist(queries), scan_dist(queries);
+    auto t0 = chrono::steady_clock::now();
+    for (int i = 0; i < queries; i++)
+        for (auto& found : pl.nearest(pts[i], k)) tree_dist[i].push_back(found.first);
+    auto t1 = chrono::steady_clock::now();
+    unordered_map<int, double> by_id;
+    for (int i = 0; i < queries; i++)
+    {
+        by_id.clear();
+        for (Segment& seg : segments)
+        {
+            double d = seg.distance(pts[i]);
+            auto it = by_id.emplace(seg.id, d).first;
+            it->second = min(it->second, d);
+        }
+        for (auto& entry : by_id) scan_dist[i].push_back(entry.second);
+        int keep = min<int>(k, scan_dist[i].size());
+        partial_sort(scan_dist[i].begin(), scan_dist[i].begin() + keep, scan_dist[i].end());
+        scan_dist[i].resize(keep);
+    }
+    auto t2 = chrono::steady_clock::now();
+
+    double tree_us = chrono::duration<double, micro>(t1 - t0).count() / queries;
+    double scan_us = chrono::duration<double, micro>(t2 - t1).count() / queries;
+    cout << "nearest " << k << ": slab search " << tree_us << " us/query, scan " << scan_us
+         << " us/query (" << scan_us / tree_us << "x)" << (tree_dist == scan_dist ? "" : "  [MISMATCH]") << endl;
+}
+
+/**
+ * Benchmark of the window query
+ * Times window() on random windows of 1/32 and 1/256 of the bounding box
+ * per side against testing every segment with meetsBox(), and checks both
+ * report the same ids. Random corners never land on a slab boundary, so
+ * windows with an edge on a segment endpoint are checked as well
+ * @pl: Built point location structure
+ * @segments: Input segments
+ * @queries: Number of random windows of each size
+ */
+void benchWindow(PointLocation& pl, vector<Segment>& segments, int queries)
+{
+    for (int parts : {32, 256})
+    {
+        mt19937 rng(13579);
+        double w = (xmax - xmin) / parts, h = (ymax - ymin) / parts;
+        uniform_real_distribution<double> dx(xmin, xmax - w);
+        uniform_real_distribution<double> dy(ymin, ymax - h);
+        vector<Point> los(queries);
+        for (int i = 0; i < queries; i++) los[i] = Point(dx(rng), dy(rng));
+
+        vector<vector<int> > tree_ids(queries), scan_ids(queries);
+        long long hits = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (int i = 0; i < queries; i++)
+            for (Segment* seg : pl.window(los[i], Point(los[i].x + w, los[i].y + h))) tree_ids[i].push_back(seg->id);
+        auto t1 = chrono::steady_clock::now();
+        for (int i = 0; i < queries; i++)
+            for (Segment& seg : segments)
+                if (seg.meetsBox(los[i], Point(los[i].x + w, los[i].y + h))) scan_ids[i].push_back(seg.id);
+        auto t2 = chrono::steady_clock::now();
+        for (int i = 0; i < queries; i++)
+        {
+            sort(tree_ids[i].begin(), tree_ids[i].end());
+            sort(scan_ids[i].begin(), scan_ids[i].end());
+            scan_ids[i].erase(unique(scan_ids[i].begin(), scan_ids[i].end()), scan_ids[i].end());
+            hits += tree_ids[i].size();
+        }
+
+        double tree_us = chrono::duration<double, micro>(t1 - t0).count() / queries;
+        double scan_us = chrono::duration<double, micro>(t2 - t1).count() / queries;
+        cout << "window 1/" << parts << ": " << (double)hits / queries << " segments/window, slab search " << tree_us
+             << " us/window, scan " << scan_us << " us/window (" << scan_us / tree_us << "x)"
+             << (tree_ids == scan_ids ? "" : "  [MISMATCH]") << endl;
+    }
+
+    // left edge on a right endpoint and right edge on a left endpoint
+    if (segments.empty()) return;
+    mt19937 rng(24680);
+    uniform_int_distribution<int> pick(0, segments.size() - 1);
+    double w = (xmax - xmin) / 256, h = (ymax - ymin) / 256;
+    int mismatches = 0;
+    for (int i = 0; i < queries; i++)
+    {
+        const Segment& seg = segments[pick(rng)];
+        Point los[2] = {Point(seg.p2.x, seg.p2.y - h), Point(seg.p1.x - w, seg.p1.y - h)};
+        for (const Point& lo : los)
+        {
+            Point hi(lo.x + w, lo.y + 2 * h);
+            vector<int> tree_ids, scan_ids;
+            for (Segment* found : pl.window(lo, hi)) tree_ids.push_back(found->id);
+            for (Segment& other : segments)
+                if (other.meetsBox(lo, hi)) scan_ids.push_back(other.id);
+            sort(tree_ids.begin(), tree_ids.end());
+            sort(scan_ids.begin(), scan_ids.end());
+            scan_ids.erase(unique(scan_ids.begin(), scan_ids.end()), scan_ids.end());
+            mismatches += tree_ids != scan_ids;
+        }
+    }
+    cout << "window on endpoints: " << 2 * queries << " windows";
+    if (mismatches) cout << "  [MISMATCH " << mismatches << "]";
+    cout << endl;
+}
+
+/**
+ * Scaling benchmark of the parallel build
+ * Builds the structure with 1, 2, 4, ... up to max_threads threads, prints
+ * the build times and checks every build answers random queries like the
+ * sequential one
+ * @segments: Input segments
+ * @max_threads: Largest thread count to try
+ */
+void benchBuild(vector<Segment>& segments, int max_threads)
+{
+    cout << "hardware threads " << thread::hardware_concurrency() << endl;
+    // answers as ids, since each build is freed before the next one
+    vector<pair<Segment*,Segment*> > result;
+    vector<pair<int,int> > reference, ids;
+    auto idOf = [](Segment* seg) { return seg ? seg->id : -1; };
+    double base_ms = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        auto t0 = chrono::steady_clock::now();
+        PointLocation* pl = new PointLocation(segments, threads);
+        auto t1 = chrono::steady_clock::now();
+        double ms = chrono::duration<double, milli>(t1 - t0).count();
+        if (threads == 1) base_ms = ms;
+
+        mt19937 rng(99);
+        uniform_real_distribution<double> dx(x_coords.front(), x_coords.back()), dy(ymin, ymax);
+        vector<Point> pts(100000);
+        for (auto& p : pts) p = Point(dx(rng), dy(rng));
+        pl->locateBatch(pts, result, false);
+        ids.clear();
+        for (auto& located : result) ids.push_back(make_pair(idOf(located.first), idOf(located.second)));
+        if (threads == 1) reference = ids;
+        bool same = ids == reference;
+        cout << "threads " << threads << ": build " << ms << " ms (speedup " << base_ms / ms << "), "
+             << pl->nodeCount() << " nodes (" << (double)pl->nodeCount() / segments.size() << " per segment)"
+             << (same ? "" : "  [MISMATCH]") << endl;
+        pl->release();
+        delete pl;
+    }
+}
+
+/**
+ * Benchmark of the crossing split
+ * Times splitCrossings() and the build on its pieces
+ * @segments: Input segments, possibly crossing
+ */
+void benchSplit(vector<Segment>& segments)
+{
+    auto t0 = chrono::steady_clock::now();
+    long long splits = 0;
+    vector<Segment> pieces = splitCrossings(segments, &splits);
+    auto t1 = chrono::steady_clock::now();
+    PointLocation* pl = new PointLocation(pieces);
+    auto t2 = chrono::steady_clock::now();
+    double split_ms = chrono::duration<double, milli>(t1 - t0).count();
+    double build_ms = chrono::duration<double, milli>(t2 - t1).count();
+    cout << segments.size() << " segments, " << splits << " splits, " << pieces.size() << " pieces, "
+         << pl->nodeCount() << " nodes" << endl;
+    cout << "split " << split_ms << " ms, build on pieces " << build_ms << " ms (split adds "
+         << 100 * split_ms / build_ms << "% to the build)" << endl;
+    pl->release();
+    delete pl;
+}
+
+// VD_NO_MAIN leaves main out, for programs that include this file as a library
+#ifndef VD_NO_MAIN
+int main(int argc, char* argv[]) {
+    // Optional flags: --buckets N (x-bucket table size), --bench Q (time Q random slab lookups),
+    // --threads T (parallel build), --bench-build T (build scaling up to T threads),
+    // --format text|binary (results file), --echo 0|1 (copy input segments to data.txt),
+    // --faces 0|1 (label faces and report the face of every query),
+    // --split 0|1 (split crossing segments first), --bench-split 1 (time the split against the build),
+    // --nearest K (report the K nearest segments of every query), --bench-nearest Q (time Q nearest queries),
+    // --window 0|1 (pair up query points as window corners), --bench-window Q (time Q window queries),
+    // --layout alloc|veb (tree nodes where the build put them, or relaid out in van Emde Boas order),
+    // --bench-layout Q (time Q queries before and after the relayout)
+    int buckets = 0, bench = 0, threads = 1, bench_build = 0, echo = 1, faces = 0, split = 0, bench_split = 0;
+    int nearest = 0, bench_nearest = 0, window = 0, bench_window = 0, bench_layout = 0;
+    bool binary = false, veb = false;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (string(argv[i]) == "--buckets") buckets = atoi(argv[++i]);
+        else if (string(argv[i]) == "--bench") bench = atoi(argv[++i]);
+        else if (string(argv[i]) == "--threads") threads = atoi(argv[++i]);
+        else if (string(argv[i]) == "--bench-build") bench_build = atoi(argv[++i]);
+        else if (string(argv[i]) == "--format") binary = string(argv[++i]) == "binary";
+        else if (string(argv[i]) == "--echo") echo = atoi(argv[++i]);
+        else if (string(argv[i]) == "--faces") faces = atoi(argv[++i]);
+        else if (string(argv[i]) == "--split") split = atoi(argv[++i]);
+        else if (string(argv[i]) == "--bench-split") bench_split = atoi(argv[++i]);
+        else if (string(argv[i]) == "--nearest") nearest = atoi(argv[++i]);
+        else if (string(argv[i]) == "--bench-nearest") bench_nearest = atoi(argv[++i]);
+        else if (string(argv[i]) == "--window") window = atoi(argv[++i]);
+        else if (string(argv[i]) == "--bench-window") bench_window = atoi(argv[++i]);
+        else if (string(argv[i]) == "--layout") veb = string(argv[++i]) == "veb";
+        else if (string(argv[i]) == "--bench-layout") bench_layout = atoi(argv[++i]);
+    }
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+    out.open(binary ? "data.bin" : "data.txt", binary);
     // Create test segments
     int n;
     cin >> n;
@@ -536,30 +2549,124 @@ int main() {
         ymax = max(ymax, y2);
         segments.push_back(Segment(Point(x1, y1), Point(x2, y2), i));
     }
-	for (const auto& seg : segments)
+    if (echo)
     {
-        out << "SEG " << seg.p1.x << " " << seg.p1.y << " "<< seg.p2.x << " " << seg.p2.y << "\n";
+        for (const auto& seg : segments)
+        {
+            out.line("SEG %g %g %g %g\n", seg.p1.x, seg.p1.y, seg.p2.x, seg.p2.y);
+        }
     }
-    PointLocation pl(segments);
-    double xq,yq;
-    cin>>xq>>yq;
-    pair<Segment*,Segment*> result = pl.locate(Point(xq, yq));
-    if (result.first != nullptr ) 
+    if (bench_split)
+    {
+        benchSplit(segments);
+        return 0;
+    }
+    if (split) segments = splitCrossings(segments);
+    if (bench_build > 0)
+    {
+        benchBuild(segments, bench_build);
+        return 0;
+    }
+    PointLocation pl(segments, threads);
+    if (bench_layout > 0)
     {
-        out << "Above "<<result.first->p1.x<<" "<<result.first->p1.y<<" "<< result.first->p2.x<<" "<<result.first->p2.y<< endl;
+        benchLayout(pl, bench_layout);
+        return 0;
     }
-    else
+    if (veb) pl.relayout();
+    if (bench > 0)
     {
-        out << "Above -100 100 100 100 \n";
+        benchSlabLookup(pl, bench, buckets > 0 ? buckets : 2 * x_coords.size());
+        benchBatchQueries(pl, bench);
+        benchGetY(segments, bench);
+        return 0;
+    }
+    if (bench_nearest > 0)
+    {
+        benchNearest(pl, segments, bench_nearest, max(1, nearest));
+        return 0;
+    }
+    if (bench_window > 0)
+    {
+        benchWindow(pl, segments, bench_window);
+        return 0;
+    }
+    // the location structure holds its own copy from here on
+    vector<Segment>().swap(segments);
+    pl.buildBuckets(buckets);
+    if (faces) pl.labelFaces();
+    // one query point per line until end of input
+    vector<Point> queries;
+    double xq,yq;
+    while (cin>>xq>>yq) queries.push_back(Point(xq, yq));
+    if (window)
+    {
+        // every two query points are opposite corners of a window; the text
+        // output lists the segments met before each WINDOW line, the binary
+        // output holds one (window index, segment id) record per segment
+        for (int i = 0; i + 1 < (int)queries.size(); i += 2)
+        {
+            Point lo(min(queries[i].x, queries[i + 1].x), min(queries[i].y, queries[i + 1].y));
+            Point hi(max(queries[i].x, queries[i + 1].x), max(queries[i].y, queries[i + 1].y));
+            for (Segment* seg : pl.window(lo, hi))
+            {
+                int record[2] = {i / 2, seg->id};
+                out.record(record, 2);
+                out.line("Hit %g %g %g %g\n", seg->p1.x, seg->p1.y, seg->p2.x, seg->p2.y);
+            }
+            out.line("WINDOW %g %g %g %g\n", lo.x, lo.y, hi.x, hi.y);
+        }
+        return 0;
     }
-    if(result.second != nullptr ) 
+    if (binary)
     {
-        out << "Below "<<result.second->p1.x<<" "<<result.second->p1.y<<" "<< result.second->p2.x<<" "<<result.second->p2.y<< endl;
-    } 
-    else 
+        // records of (query index, segment above, segment below), -1 for none,
+        // followed by the face id with --faces 1 and the ids of the nearest
+        // segments with --nearest K, -1 past the last one
+        pl.freeze();
+        vector<pair<Segment*,Segment*> > results;
+        pl.locateBatch(queries, results, true);
+        vector<int> record;
+        for (int i = 0; i < (int)queries.size(); i++)
+        {
+            record = {i, results[i].first ? results[i].first->id : -1,
+                      results[i].second ? results[i].second->id : -1};
+            if (faces) record.push_back(pl.faceOf(results[i]));
+            if (nearest > 0)
+            {
+                vector<pair<double,Segment*> > near = pl.nearest(queries[i], nearest);
+                for (int j = 0; j < nearest; j++) record.push_back(j < (int)near.size() ? near[j].second->id : -1);
+            }
+            out.record(record.data(), record.size());
+        }
+        return 0;
+    }
+    for (const Point& q : queries)
     {
-        out << "Below -100 -100 100 -100 \n";
+        pair<Segment*,Segment*> result = pl.locate(q);
+        if (result.first != nullptr ) 
+        {
+            out.line("Above %g %g %g %g\n", result.first->p1.x, result.first->p1.y, result.first->p2.x, result.first->p2.y);
+        }
+        else
+        {
+            out.line("Above -100 100 100 100 \n");
+        }
+        if(result.second != nullptr ) 
+        {
+            out.line("Below %g %g %g %g\n", result.second->p1.x, result.second->p1.y, result.second->p2.x, result.second->p2.y);
+        } 
+        else 
+        {
+            out.line("Below -100 -100 100 -100 \n");
+        }
+        if (faces) out.line("FACE %d\n", pl.faceOf(result));
+        if (nearest > 0)
+            for (auto& near : pl.nearest(q, nearest))
+                out.line("Nearest %g %g %g %g %g\n", near.second->p1.x, near.second->p1.y,
+                         near.second->p2.x, near.second->p2.y, near.first);
+        out.line("QUERY %g %g\n", q.x, q.y);
     }
-    out << "QUERY " << xq << " " << yq << "\n";
     return 0;
 }
+#endif
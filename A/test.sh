@@ -1,4 +1,4 @@
 python3 generator.py $1
-g++ -o vd VD.cpp
+g++ -O2 -pthread -o vd VD.cpp
 ./vd < input.txt
 python3 draw.py
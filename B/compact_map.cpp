@@ -0,0 +1,164 @@
+#include "structures.h"
+
+/**
+ * Build method
+ * Converts a finished map into the compact index-based form
+ * @map: Built map, frozen here so trapezoid indices match map._flat
+ * Points are deduplicated by exact value, and XNodes refer to an endpoint
+ * with their x. Node tests are taken from the
+ * original XNode/YNode, so localize() gives the same trapezoid as
+ * TrapezoidMap::localize().
+ */
+void CompactMap::build(TrapezoidMap& map)
+{
+	map.freeze();
+	points.clear();
+	segments.clear();
+	segmentIds.clear();
+	trapezoids.clear();
+	nodes.clear();
+
+	std::map<pair<float, float>, uint32_t> pointIndex;
+	auto indexOfPoint = [&](Point pt)
+	{
+		auto it = pointIndex.find(make_pair(pt.x, pt.y));
+		if (it != pointIndex.end()) return it->second;
+		points.push_back(pt);
+		return pointIndex[make_pair(pt.x, pt.y)] = points.size() - 1;
+	};
+	unordered_map<const Segment*, uint32_t> segIndex;
+	auto indexOfSeg = [&](const Segment* seg)
+	{
+		auto it = segIndex.find(seg);
+		if (it != segIndex.end()) return it->second;
+		CompactSegment rec;
+		rec.left = indexOfPoint(seg->ptLeft);
+		rec.right = indexOfPoint(seg->ptRight);
+		segments.push_back(rec);
+		segmentIds.push_back(seg->id);
+		return segIndex[seg] = segments.size() - 1;
+	};
+
+	const FlatDag& flat = map._flat;
+	unordered_map<const Trapezoid*, int32_t> trIndex;
+	for (size_t i = 0; i < flat.trapezoids.size(); ++i) trIndex[flat.trapezoids[i]] = i;
+	auto indexOfTr = [&](const Trapezoid* tp)
+	{
+		auto it = tp ? trIndex.find(tp) : trIndex.end();
+		return it == trIndex.end() ? -1 : it->second;
+	};
+	for (const Trapezoid* tp : flat.trapezoids)
+	{
+		CompactTrapezoid rec;
+		rec.top = indexOfSeg(tp->top);
+		rec.bot = indexOfSeg(tp->bot);
+		rec.left = indexOfPoint(tp->left);
+		rec.right = indexOfPoint(tp->right);
+		rec.trLeftTop = indexOfTr(tp->trLeftTop);
+		rec.trLeftBot = indexOfTr(tp->trLeftBot);
+		rec.trRightTop = indexOfTr(tp->trRightTop);
+		rec.trRightBot = indexOfTr(tp->trRightBot);
+		trapezoids.push_back(rec);
+	}
+
+	// an XNode refers to any point with its x; all of them are endpoints
+	unordered_map<float, uint32_t> xIndex;
+	for (size_t i = 0; i < points.size(); ++i) xIndex.emplace(points[i].x, i);
+	auto indexOfX = [&](float x)
+	{
+		auto it = xIndex.find(x);
+		return it != xIndex.end() ? it->second : indexOfPoint(Point(x, 0));
+	};
+
+	// same numbering as the FlatDag, which is BFS over the same graph
+	unordered_map<GraphNode*, int32_t> nodeIndex;
+	vector<GraphNode*> order;
+	auto indexOfNode = [&](GraphNode* node) -> int32_t
+	{
+		if (node->getTrapezoid()) return ~trIndex[node->getTrapezoid()];
+		auto it = nodeIndex.find(node);
+		if (it != nodeIndex.end()) return it->second;
+		order.push_back(node);
+		return nodeIndex[node] = order.size() - 1;
+	};
+	root = map._rootNode ? indexOfNode(map._rootNode) : 0;
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		GraphNode* node = order[i];
+		CompactNode rec;
+		if (XNode* xn = dynamic_cast<XNode*>(node))
+			rec.ref = ~(int32_t)indexOfX(xn->_point);
+		else
+			rec.ref = indexOfSeg(static_cast<YNode*>(node)->_segment);
+		rec.child[0] = indexOfNode(node->_left);
+		rec.child[1] = indexOfNode(node->_right);
+		nodes.push_back(rec);
+	}
+}
+
+/**
+ * Localize method
+ * Walks the compact DAG with the same tests as XNode and YNode
+ */
+int CompactMap::localize(Point pt) const
+{
+	int32_t cur = root;
+	while (cur >= 0)
+	{
+		const CompactNode& node = nodes[cur];
+		bool left;
+		if (node.ref < 0)
+		{
+			left = pt.x < points[~node.ref].x;
+		}
+		else
+		{
+			const Point& a = points[segments[node.ref].left];
+			const Point& b = points[segments[node.ref].right];
+			left = orient2d(a.x, a.y, b.x, b.y, pt.x, pt.y) > 0;
+		}
+		cur = node.child[left ? 0 : 1];
+	}
+	return ~cur;
+}
+
+size_t CompactMap::bytes() const
+{
+	return points.size() * sizeof(Point) + segments.size() * sizeof(CompactSegment) +
+		   segmentIds.size() * sizeof(int32_t) + trapezoids.size() * sizeof(CompactTrapezoid) +
+		   nodes.size() * sizeof(CompactNode);
+}
+
+/**
+ * PointerBytes method
+ * Memory held by the pointer-based map: every DAG node reachable from the
+ * root with its _parents vector, every live trapezoid and the segment
+ * arrays. Allocator overhead and nodes orphaned during construction are
+ * not counted, so this is a lower bound.
+ */
+size_t TrapezoidMap::pointerBytes()
+{
+	size_t total = _segments.capacity() * sizeof(Segment);
+	for (auto& pieces : _stripSegments) total += pieces.capacity() * sizeof(Segment);
+	for (TrapezoidMap* strip : _strips) total += strip->_segments.capacity() * sizeof(Segment);
+	if (!_rootNode) return total;
+
+	unordered_set<GraphNode*> seen;
+	vector<GraphNode*> stack(1, _rootNode);
+	seen.insert(_rootNode);
+	while (!stack.empty())
+	{
+		GraphNode* node = stack.back();
+		stack.pop_back();
+		total += node->_parents.capacity() * sizeof(GraphNode*);
+		if (node->getTrapezoid())
+		{
+			total += sizeof(TerminalNode) + sizeof(Trapezoid);
+			continue;
+		}
+		total += dynamic_cast<XNode*>(node) ? sizeof(XNode) : sizeof(YNode);
+		for (GraphNode* child : {node->_left, node->_right})
+			if (seen.insert(child).second) stack.push_back(child);
+	}
+	return total;
+}
@@ -0,0 +1,283 @@
+#include "structures.h"
+
+/**
+ * Event order of the sweep on B's float points: by x, then by y, so the
+ * points of a vertical line come bottom first
+ */
+static bool lexLess(Point a, Point b)
+{
+	return a.x != b.x ? a.x < b.x : a.y < b.y;
+}
+
+/**
+ * CrossingSweep class
+ * One Bentley–Ottmann pass of splitCrossings(), O((n + k) log n) for k
+ * intersections, producing pieces buildMap() can insert. Events at one
+ * point pop as ends, then crossings, then starts. _status keeps the piece
+ * of each segment under the sweep point, bottom to top, and _result
+ * collects finished pieces as Segments with their input id. The crossing
+ * tests use orient2d() on the float endpoints, so they are exact; a cut
+ * point is rounded to float and may leave a new crossing for the next
+ * pass. A segment ending inside another one cuts it as well, while
+ * collinear overlaps are passed through uncut.
+ */
+class CrossingSweep
+{
+public:
+	long long splits; // pieces cut off at an intersection
+
+	CrossingSweep(): splits(0), _status(StatusOrder{this}) {}
+	vector<Segment> run(const vector<Segment>& segments);
+
+private:
+	struct StatusOrder
+	{
+		CrossingSweep* sweep;
+		bool operator()(int i, int j) const { return sweep->below(i, j); }
+	};
+	struct Piece
+	{
+		Point left, right;
+		int id;
+		int next; // piece continuing this one after a split, -1 if none
+		double slope; // +inf for a vertical piece
+		set<int, StatusOrder>::iterator pos;
+	};
+	enum EventKind { EVENT_END, EVENT_CROSS, EVENT_START };
+	struct Event
+	{
+		Point p;
+		int kind;
+		int a, b;
+		bool operator>(const Event& e) const
+		{
+			if (p.x != e.p.x) return p.x > e.p.x;
+			if (p.y != e.p.y) return p.y > e.p.y;
+			return kind > e.kind;
+		}
+	};
+
+	vector<Piece> 	_pieces;
+	vector<Segment> _result;
+	Point 			_sweep;
+	set<int, StatusOrder> _status;
+	priority_queue<Event, vector<Event>, greater<Event>> _events;
+
+	double yAtSweep(const Piece& s);
+	bool below(int i, int j);
+	int liveAt(int i, Point p);
+	int addPiece(Point left, Point right, int id);
+	void check(int i, int j);
+	int neighbour(int i, bool above);
+	void split(vector<int>& cut);
+};
+
+/**
+ * Height of a piece at the sweep x, in double. Ends at the sweep x give
+ * their stored y rather than an interpolation, and a vertical piece gives
+ * the sweep y clamped to its extent
+ */
+double CrossingSweep::yAtSweep(const Piece& s)
+{
+	if (s.left.x == s.right.x) return min(max(_sweep.y, s.left.y), s.right.y);
+	if (_sweep.x == s.left.x) return s.left.y;
+	if (_sweep.x == s.right.x) return s.right.y;
+	return s.left.y + s.slope * ((double)_sweep.x - s.left.x);
+}
+
+/**
+ * Comparator of _status. Equal heights are broken by slope: once the sweep
+ * stands on the shared point the pieces are ordered as they leave it,
+ * before that as they arrive. Input id and piece index make it strict
+ */
+bool CrossingSweep::below(int i, int j)
+{
+	const Piece& a = _pieces[i];
+	const Piece& b = _pieces[j];
+	double ya = yAtSweep(a), yb = yAtSweep(b);
+	if (ya != yb) return ya < yb;
+	if (a.slope != b.slope) return ya <= _sweep.y ? a.slope < b.slope : a.slope > b.slope;
+	if (a.id != b.id) return a.id < b.id;
+	return i < j;
+}
+
+/**
+ * Piece of i's split chain that holds p; a split keeps the left part
+ * under the old index and links the right part through next
+ */
+int CrossingSweep::liveAt(int i, Point p)
+{
+	while (_pieces[i].next >= 0 && !lexLess(p, _pieces[i].right)) i = _pieces[i].next;
+	return i;
+}
+
+int CrossingSweep::addPiece(Point left, Point right, int id)
+{
+	Piece s;
+	s.left = left;
+	s.right = right;
+	s.id = id;
+	s.next = -1;
+	s.slope = left.x == right.x ? HUGE_VAL : ((double)right.y - left.y) / ((double)right.x - left.x);
+	_pieces.push_back(s);
+	return _pieces.size() - 1;
+}
+
+/**
+ * Pushes a cross event for two pieces adjacent in _status, either -1 for
+ * none, when they cross properly or one ends inside the other
+ */
+void CrossingSweep::check(int i, int j)
+{
+	if (i < 0 || j < 0) return;
+	const Piece& a = _pieces[i];
+	const Piece& b = _pieces[j];
+	int o1 = orient2d(a.left.x, a.left.y, a.right.x, a.right.y, b.left.x, b.left.y);
+	int o2 = orient2d(a.left.x, a.left.y, a.right.x, a.right.y, b.right.x, b.right.y);
+	int o3 = orient2d(b.left.x, b.left.y, b.right.x, b.right.y, a.left.x, a.left.y);
+	int o4 = orient2d(b.left.x, b.left.y, b.right.x, b.right.y, a.right.x, a.right.y);
+	Point p;
+	if (o1 * o2 < 0 && o3 * o4 < 0)
+	{
+		double dax = (double)a.right.x - a.left.x, day = (double)a.right.y - a.left.y;
+		double dbx = (double)b.right.x - b.left.x, dby = (double)b.right.y - b.left.y;
+		double t = (((double)b.left.x - a.left.x) * dby - ((double)b.left.y - a.left.y) * dbx) / (dax * dby - day * dbx);
+		p = Point(a.left.x + t * dax, a.left.y + t * day);
+		// float rounding may leave the overlap of the two boxes; clamp back
+		p.x = min(max(p.x, max(a.left.x, b.left.x)), min(a.right.x, b.right.x));
+		p.y = min(max(p.y, max(min(a.left.y, a.right.y), min(b.left.y, b.right.y))),
+				  min(max(a.left.y, a.right.y), max(b.left.y, b.right.y)));
+	}
+	else if (o1 == 0 && o2 != 0 && lexLess(a.left, b.left) && lexLess(b.left, a.right)) p = b.left;
+	else if (o2 == 0 && o1 != 0 && lexLess(a.left, b.right) && lexLess(b.right, a.right)) p = b.right;
+	else if (o3 == 0 && o4 != 0 && lexLess(b.left, a.left) && lexLess(a.left, b.right)) p = a.left;
+	else if (o4 == 0 && o3 != 0 && lexLess(b.left, a.right) && lexLess(a.right, b.right)) p = a.right;
+	else return;
+	if (lexLess(p, _sweep)) p = _sweep;
+	_events.push(Event{p, EVENT_CROSS, i, j});
+}
+
+int CrossingSweep::neighbour(int i, bool above)
+{
+	auto it = _pieces[i].pos;
+	if (above) return ++it == _status.end() ? -1 : *it;
+	return it == _status.begin() ? -1 : *--it;
+}
+
+/**
+ * Cuts every piece in cut at the sweep point
+ * The left parts go to _result. The right parts enter _status only after
+ * the last cut, so none of them is tested against a piece still running
+ * through the point. Right parts and pieces starting at the point lie next
+ * to each other in _status, and only the two ends of that run get a new
+ * neighbour to test
+ */
+void CrossingSweep::split(vector<int>& cut)
+{
+	vector<int> added;
+	for (int i : cut)
+	{
+		Piece& s = _pieces[i];
+		if (s.next >= 0 || !lexLess(s.left, _sweep) || !lexLess(_sweep, s.right)) continue;
+		_status.erase(s.pos);
+		_result.push_back(Segment(s.left, _sweep, s.id));
+		int j = addPiece(_sweep, _pieces[i].right, _pieces[i].id);
+		_pieces[i].right = _sweep;
+		_pieces[i].next = j;
+		added.push_back(j);
+	}
+	splits += added.size();
+	for (int j : added) _pieces[j].pos = _status.insert(j).first;
+	// widen each right part to the run leaving the sweep point, test its ends
+	auto startsHere = [&](int k) { return k >= 0 && _pieces[k].left.x == _sweep.x && _pieces[k].left.y == _sweep.y; };
+	for (int j : added)
+	{
+		int lo = j, hi = j;
+		while (startsHere(neighbour(lo, false))) lo = neighbour(lo, false);
+		while (startsHere(neighbour(hi, true))) hi = neighbour(hi, true);
+		check(neighbour(lo, false), lo);
+		check(hi, neighbour(hi, true));
+	}
+}
+
+/**
+ * Run method
+ * Splits the segments at all their intersections
+ * @segments: Input segments
+ * Returns the pieces, each with the id of its input segment
+ */
+vector<Segment> CrossingSweep::run(const vector<Segment>& segments)
+{
+	for (const Segment& seg : segments)
+	{
+		// a zero-length segment is kept as it is; its end event would pop first
+		if (seg.ptLeft.x == seg.ptRight.x && seg.ptLeft.y == seg.ptRight.y)
+		{
+			_result.push_back(seg);
+			continue;
+		}
+		int i = addPiece(seg.ptLeft, seg.ptRight, seg.id);
+		_events.push(Event{seg.ptLeft, EVENT_START, i, -1});
+		_events.push(Event{seg.ptRight, EVENT_END, i, -1});
+	}
+	while (!_events.empty())
+	{
+		Event e = _events.top();
+		_events.pop();
+		_sweep = e.p;
+		if (e.kind == EVENT_START)
+		{
+			_pieces[e.a].pos = _status.insert(e.a).first;
+			check(neighbour(e.a, false), e.a);
+			check(e.a, neighbour(e.a, true));
+		}
+		else if (e.kind == EVENT_END)
+		{
+			int i = liveAt(e.a, e.p);
+			int lo = neighbour(i, false), hi = neighbour(i, true);
+			_status.erase(_pieces[i].pos);
+			_result.push_back(Segment(_pieces[i].left, _pieces[i].right, _pieces[i].id));
+			check(lo, hi);
+		}
+		else
+		{
+			// take the other cross events at this point and cut them together
+			vector<int> cut = {liveAt(e.a, e.p), liveAt(e.b, e.p)};
+			while (!_events.empty() && _events.top().kind == EVENT_CROSS
+				   && _events.top().p.x == e.p.x && _events.top().p.y == e.p.y)
+			{
+				cut.push_back(liveAt(_events.top().a, e.p));
+				cut.push_back(liveAt(_events.top().b, e.p));
+				_events.pop();
+			}
+			split(cut);
+		}
+	}
+	return _result;
+}
+
+/**
+ * SplitCrossings function
+ * Cuts crossing segments at their intersection points (see CrossingSweep)
+ * @segments: Input segments, possibly crossing
+ * @splits: If set, receives the number of cuts made
+ * Cut points are stored as float, B's coordinate type, and the rounding
+ * can make two short pieces cross again. Passes therefore repeat on the
+ * pieces of the last one until a pass makes no cut, up to
+ * MAX_SPLIT_PASSES; inputs seldom need more than two
+ */
+vector<Segment> splitCrossings(const vector<Segment>& segments, long long* splits)
+{
+	const int MAX_SPLIT_PASSES = 4;
+	vector<Segment> pieces = segments;
+	long long total = 0;
+	for (int pass = 0; pass < MAX_SPLIT_PASSES; ++pass)
+	{
+		CrossingSweep sweep;
+		pieces = sweep.run(pieces);
+		total += sweep.splits;
+		if (sweep.splits == 0) break;
+	}
+	if (splits) *splits = total;
+	return pieces;
+}
@@ -0,0 +1,344 @@
+#include "structures.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// estimated peak bytes per segment of one strip build: the pointer map, its
+// FlatDag and the tables of save(), measured at 2.7 to 3.6 KB
+static const size_t EXTERNAL_BYTES_PER_SEGMENT = 4096;
+// records moved per fread/fwrite while merging strip images
+static const size_t EXTERNAL_CHUNK = 4096;
+
+static uint64_t alignUp(uint64_t offset)
+{
+	return (offset + 63) & ~(uint64_t)63;
+}
+
+/**
+ * Sorted run reader for the k-way merge of endpoint x-coordinates
+ */
+struct RunReader
+{
+	FILE* 	file;
+	float 	head;
+	bool next() { return fread(&head, sizeof(float), 1, file) == 1; }
+};
+
+/**
+ * Y of a segment record on the vertical line x, exact at its endpoints
+ */
+static float yAtX(const ImageSegment& seg, float x)
+{
+	if (seg.ptLeft.x == x) return seg.ptLeft.y;
+	if (seg.ptRight.x == x) return seg.ptRight.y;
+	return Segment(seg.ptLeft, seg.ptRight).ptWithX(x).y;
+}
+
+/**
+ * Appends count records of one array of a strip image to an output file,
+ * remapping every record with fix
+ */
+template <class T, class Fix>
+static bool appendRecords(FILE* in, uint64_t offset, uint32_t count, FILE* out, Fix fix)
+{
+	vector<T> buffer(EXTERNAL_CHUNK);
+	if (fseeko(in, offset, SEEK_SET) != 0) return false;
+	for (uint32_t done = 0; done < count; )
+	{
+		size_t n = min<size_t>(EXTERNAL_CHUNK, count - done);
+		if (fread(buffer.data(), sizeof(T), n, in) != n) return false;
+		for (size_t i = 0; i < n; ++i) fix(buffer[i], done + i);
+		if (fwrite(buffer.data(), sizeof(T), n, out) != n) return false;
+		done += n;
+	}
+	return true;
+}
+
+/**
+ * Copies a whole file to out, then pads out to a 64-byte boundary
+ */
+static bool appendFile(FILE* out, const string& path)
+{
+	FILE* in = fopen(path.c_str(), "rb");
+	if (!in) return false;
+	vector<char> buffer(1 << 20);
+	size_t n;
+	bool ok = true;
+	while (ok && (n = fread(buffer.data(), 1, buffer.size(), in)) > 0)
+		ok = fwrite(buffer.data(), 1, n, out) == n;
+	fclose(in);
+	uint64_t pos = ftello(out);
+	static const char zeros[64] = {};
+	return ok && fwrite(zeros, 1, alignUp(pos) - pos, out) == alignUp(pos) - pos;
+}
+
+/**
+ * BuildExternal function
+ * Builds a map image for more segments than fit in memory
+ * @in: Stream holding the segment count and the segments
+ * @path: Image to write, loadable with MappedMap like one written by save()
+ * @budget: Target peak RSS in bytes of each step
+ * 1. The segments are streamed to a scratch file, and their endpoint
+ *    x-coordinates are sorted in runs of budget / 2 bytes written to disk.
+ * 2. A k-way merge of the runs places strip boundaries so that a strip
+ *    holds about budget / EXTERNAL_BYTES_PER_SEGMENT segments, in the gap
+ *    between two distinct x-coordinates as buildMapParallel() does.
+ * 3. Segments are clipped into one scratch file per strip.
+ * 4. Each strip is built and saved as an image by a child process, so the
+ *    whole map of one strip is returned to the system when it exits. The
+ *    parent appends its segments, trapezoids and nodes to the three arrays
+ *    of the output with indices shifted, and links the trapezoids on both
+ *    sides of the boundary to the previous strip.
+ * 5. A balanced tree of XNodes on the boundaries goes on top of the strip
+ *    roots, and the arrays are joined behind the header.
+ * Queries give the same top and bottom segment ids as buildMapParallel()
+ * with the same boundaries. Scratch files are path + ".tmp.*".
+ */
+bool buildExternal(istream& in, const char* path, size_t budget)
+{
+	const Point boxMin(-100, -100), boxMax(100, 100);
+	string base = string(path) + ".tmp.";
+	vector<string> scratch;
+	auto scratchFile = [&](const string& name, const char* mode)
+	{
+		scratch.push_back(base + name);
+		return fopen(scratch.back().c_str(), mode);
+	};
+	auto cleanup = [&]() { for (const string& name : scratch) remove(name.c_str()); };
+	struct rusage usage;
+
+	// 1. segments to disk, endpoint x-coordinates in sorted runs
+	FILE* segFile = scratchFile("segments", "w+b");
+	if (!segFile) return false;
+	size_t runLength = max<size_t>(1024, budget / 2 / sizeof(float));
+	vector<float> xs;
+	xs.reserve(runLength);
+	vector<RunReader> runs;
+	auto flushRun = [&]()
+	{
+		sort(xs.begin(), xs.end());
+		FILE* run = scratchFile("run" + to_string(runs.size()), "w+b");
+		if (!run) return false;
+		bool ok = fwrite(xs.data(), sizeof(float), xs.size(), run) == xs.size();
+		rewind(run);
+		runs.push_back(RunReader{run, 0});
+		xs.clear();
+		return ok;
+	};
+	long long N = 0;
+	in >> N;
+	bool ok = true;
+	for (long long i = 0; i < N && ok; ++i)
+	{
+		float x1, y1, x2, y2;
+		in >> x1 >> y1 >> x2 >> y2;
+		Segment seg(Point(x1, y1), Point(x2, y2), i);
+		ImageSegment rec = ImageSegment();
+		rec.ptLeft = seg.ptLeft;
+		rec.ptRight = seg.ptRight;
+		rec.id = seg.id;
+		ok = fwrite(&rec, sizeof(rec), 1, segFile) == 1;
+		xs.push_back(seg.ptLeft.x);
+		xs.push_back(seg.ptRight.x);
+		if (xs.size() >= runLength) ok = ok && flushRun();
+	}
+	if (ok && !xs.empty()) ok = flushRun();
+	vector<float>().swap(xs);
+
+	// 2. strip boundaries from the merged runs
+	size_t perStrip = max<size_t>(2, 2 * budget / EXTERNAL_BYTES_PER_SEGMENT);
+	vector<float> bounds;
+	auto later = [&](int a, int b) { return runs[a].head > runs[b].head; };
+	priority_queue<int, vector<int>, decltype(later)> heads(later);
+	for (size_t r = 0; r < runs.size(); ++r)
+		if (runs[r].next()) heads.push(r);
+	size_t count = 0;
+	float last = 0;
+	while (!heads.empty())
+	{
+		int r = heads.top();
+		heads.pop();
+		float x = runs[r].head;
+		if (runs[r].next()) heads.push(r);
+		if (count >= perStrip && x != last)
+		{
+			float b = (last + x) / 2;
+			// adjacent floats have no value strictly between them
+			if (b > last && b < x && b > boxMin.x && b < boxMax.x)
+			{
+				bounds.push_back(b);
+				count = 0;
+			}
+		}
+		++count;
+		last = x;
+	}
+	for (RunReader& run : runs) fclose(run.file);
+	int n = bounds.size() + 1;
+	auto stripOf = [&](float x) { return (int)(upper_bound(bounds.begin(), bounds.end(), x) - bounds.begin()); };
+
+	// 3. clip the segments into one file per strip
+	vector<FILE*> stripFiles(n);
+	for (int s = 0; s < n && ok; ++s)
+		ok = (stripFiles[s] = scratchFile("strip" + to_string(s), "wb")) != nullptr;
+	rewind(segFile);
+	ImageSegment rec;
+	long long pieces = 0;
+	while (ok && fread(&rec, sizeof(rec), 1, segFile) == 1)
+	{
+		Segment seg(rec.ptLeft, rec.ptRight, rec.id);
+		int sl = stripOf(seg.ptLeft.x), sr = stripOf(seg.ptRight.x);
+		for (int s = sl; s <= sr && ok; ++s)
+		{
+			ImageSegment piece = rec;
+			piece.ptLeft = (s == sl) ? seg.ptLeft : seg.ptWithX(bounds[s - 1]);
+			piece.ptRight = (s == sr) ? seg.ptRight : seg.ptWithX(bounds[s]);
+			ok = fwrite(&piece, sizeof(piece), 1, stripFiles[s]) == 1;
+			++pieces;
+		}
+	}
+	fclose(segFile);
+	for (FILE* file : stripFiles) if (file && fclose(file) != 0) ok = false;
+
+	// 4. build the strips one at a time and append them to the three arrays
+	FILE* segOut = scratchFile("segs", "w+b");
+	FILE* trOut = scratchFile("traps", "w+b");
+	FILE* nodeOut = scratchFile("nodes", "w+b");
+	ok = ok && segOut && trOut && nodeOut;
+	uint32_t segCount = 0, trCount = 0, nodeCount = 0;
+	vector<int> stripRoots(n);
+	vector<pair<float, uint32_t>> prevRight; // (bottom y, trapezoid) along the last boundary
+	long maxChildRss = 0;
+	for (int s = 0; s < n && ok; ++s)
+	{
+		string stripPath = base + "strip" + to_string(s);
+		string imagePath = stripPath + ".img";
+		scratch.push_back(imagePath);
+		Point lo(s == 0 ? boxMin.x : bounds[s - 1], boxMin.y);
+		Point hi(s == n - 1 ? boxMax.x : bounds[s], boxMax.y);
+		cout.flush();
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			vector<Segment> segments;
+			FILE* file = fopen(stripPath.c_str(), "rb");
+			ImageSegment piece;
+			while (file && fread(&piece, sizeof(piece), 1, file) == 1)
+				segments.push_back(Segment(piece.ptLeft, piece.ptRight, piece.id));
+			if (file) fclose(file);
+			TrapezoidMap map;
+			map.buildMap(segments, lo, hi);
+			_exit(file && map.save(imagePath.c_str()) ? 0 : 1);
+		}
+		int status = 0;
+		ok = pid > 0 && wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		if (!ok) break;
+		maxChildRss = max(maxChildRss, usage.ru_maxrss);
+		remove(stripPath.c_str());
+
+		FILE* image = fopen(imagePath.c_str(), "rb");
+		ImageHeader header;
+		ok = image && fread(&header, sizeof(header), 1, image) == 1;
+		vector<ImageSegment> segs(ok ? header.segmentCount : 0);
+		ok = ok && fseeko(image, header.segmentOffset, SEEK_SET) == 0
+			&& fread(segs.data(), sizeof(ImageSegment), segs.size(), image) == segs.size()
+			&& fwrite(segs.data(), sizeof(ImageSegment), segs.size(), segOut) == segs.size();
+		vector<pair<float, uint32_t>> left, right;
+		auto fixTrapezoid = [&](ImageTrapezoid& tr, uint32_t i)
+		{
+			if (s > 0 && tr.left.x == lo.x && tr.right.x > lo.x) left.push_back(make_pair(yAtX(segs[tr.bot], lo.x), trCount + i));
+			if (s < n - 1 && tr.right.x == hi.x && tr.left.x < hi.x) right.push_back(make_pair(yAtX(segs[tr.bot], hi.x), trCount + i));
+			tr.top += segCount;
+			tr.bot += segCount;
+			int32_t* links[4] = {&tr.trLeftTop, &tr.trLeftBot, &tr.trRightTop, &tr.trRightBot};
+			for (int32_t* link : links) if (*link >= 0) *link += trCount;
+		};
+		auto fixNode = [&](FlatNode& node, uint32_t)
+		{
+			for (int& child : node.child) child = child >= 0 ? child + nodeCount : ~(~child + trCount);
+		};
+		ok = ok && appendRecords<ImageTrapezoid>(image, header.trapezoidOffset, header.trapezoidCount, trOut, fixTrapezoid)
+			&& appendRecords<FlatNode>(image, header.nodeOffset, header.nodeCount, nodeOut, fixNode);
+		if (image) fclose(image);
+		remove(imagePath.c_str());
+		if (!ok) break;
+		stripRoots[s] = header.root >= 0 ? header.root + nodeCount : ~(~header.root + trCount);
+
+		// link across the boundary; both sides see the same crossing pieces,
+		// so the trapezoids pair up in order of their bottom segment
+		sort(left.begin(), left.end());
+		if (s > 0 && left.size() != prevRight.size())
+		{
+			cerr << "external build: strip " << s << " has " << left.size() << " trapezoids on its left boundary but strip "
+				 << s - 1 << " has " << prevRight.size() << " on its right" << endl;
+			ok = false;
+			break;
+		}
+		if (s > 0)
+		{
+			for (size_t i = 0; i < left.size() && ok; ++i)
+			{
+				int32_t links[2];
+				links[0] = left[i].second;
+				links[1] = -1;
+				ok = fseeko(trOut, (off_t)prevRight[i].second * sizeof(ImageTrapezoid) + offsetof(ImageTrapezoid, trRightTop), SEEK_SET) == 0
+					&& fwrite(links, sizeof(links), 1, trOut) == 1;
+				links[0] = prevRight[i].second;
+				ok = ok && fseeko(trOut, (off_t)left[i].second * sizeof(ImageTrapezoid) + offsetof(ImageTrapezoid, trLeftTop), SEEK_SET) == 0
+					&& fwrite(links, sizeof(links), 1, trOut) == 1;
+			}
+			ok = ok && fseeko(trOut, 0, SEEK_END) == 0;
+		}
+		sort(right.begin(), right.end());
+		prevRight.swap(right);
+		segCount += header.segmentCount;
+		trCount += header.trapezoidCount;
+		nodeCount += header.nodeCount;
+	}
+
+	// 5. x-split tree over the strip roots, then the image itself
+	function<int(int, int)> combine = [&](int lo, int hi) -> int
+	{
+		if (hi - lo == 1) return stripRoots[lo];
+		int mid = (lo + hi) / 2;
+		FlatNode node = FlatNode();
+		node.x0 = node.x1 = bounds[mid - 1];
+		node.y1 = 1;
+		node.child[0] = combine(lo, mid);
+		node.child[1] = combine(mid, hi);
+		ok = ok && fwrite(&node, sizeof(node), 1, nodeOut) == 1;
+		return nodeCount++;
+	};
+	int root = ok ? combine(0, n) : 0;
+
+	ImageHeader header = ImageHeader();
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.version = IMAGE_VERSION;
+	header.root = root;
+	header.segmentCount = segCount;
+	header.trapezoidCount = trCount;
+	header.nodeCount = nodeCount;
+	header.boxMin = boxMin;
+	header.boxMax = boxMax;
+	header.segmentOffset = alignUp(sizeof(ImageHeader));
+	header.trapezoidOffset = alignUp(header.segmentOffset + segCount * sizeof(ImageSegment));
+	header.nodeOffset = alignUp(header.trapezoidOffset + trCount * sizeof(ImageTrapezoid));
+	header.fileSize = header.nodeOffset + nodeCount * sizeof(FlatNode);
+	for (FILE* file : {segOut, trOut, nodeOut}) if (file && fclose(file) != 0) ok = false;
+
+	FILE* out = ok ? fopen(path, "wb") : nullptr;
+	static const char zeros[64] = {};
+	ok = out && fwrite(&header, sizeof(header), 1, out) == 1
+		&& fwrite(zeros, 1, header.segmentOffset - sizeof(header), out) == header.segmentOffset - sizeof(header)
+		&& appendFile(out, base + "segs") && appendFile(out, base + "traps") && appendFile(out, base + "nodes");
+	// the last array needs no padding
+	ok = ok && fflush(out) == 0 && ftruncate(fileno(out), header.fileSize) == 0;
+	if (out && fclose(out) != 0) ok = false;
+	cleanup();
+
+	getrusage(RUSAGE_SELF, &usage);
+	cout << "external build: " << N << " segments, " << n << " strips, " << pieces << " pieces, peak RSS "
+		 << maxChildRss / 1024 << " MB per strip build, " << usage.ru_maxrss / 1024 << " MB in the merge (budget "
+		 << budget / (1 << 20) << " MB)" << endl;
+	return ok;
+}
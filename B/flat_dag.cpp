@@ -0,0 +1,353 @@
+#include "structures.h"
+#include <immintrin.h>
+
+// GCC 12's AVX-512 intrinsics use self-initialized "undefined" registers internally
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/**
+ * Build method
+ * Flattens the DAG below rootNode into an array of FlatNodes
+ * @rootNode: Root of a finished DAG
+ * Nodes are numbered in BFS order so the top levels, which every query
+ * visits, are packed together. Shared subgraphs are flattened once.
+ */
+void FlatDag::build(GraphNode* rootNode)
+{
+	nodes.clear();
+	trapezoids.clear();
+	if (!rootNode) return;
+
+	unordered_map<GraphNode*, int> index;
+	vector<GraphNode*> order;
+	auto indexOf = [&](GraphNode* node) -> int
+	{
+		auto it = index.find(node);
+		if (it != index.end()) return it->second;
+		int id;
+		if (node->getTrapezoid())
+		{
+			id = ~(int)trapezoids.size();
+			trapezoids.push_back(node->getTrapezoid());
+		}
+		else
+		{
+			id = order.size();
+			order.push_back(node);
+		}
+		index[node] = id;
+		return id;
+	};
+
+	root = indexOf(rootNode);
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		GraphNode* node = order[i];
+		FlatNode flat = FlatNode();
+		if (XNode* xn = dynamic_cast<XNode*>(node))
+		{
+			flat.x0 = flat.x1 = xn->_point;
+			flat.y1 = 1;
+		}
+		else
+		{
+			Segment* seg = static_cast<YNode*>(node)->_segment;
+			flat.x0 = seg->ptLeft.x;
+			flat.y0 = seg->ptLeft.y;
+			flat.x1 = seg->ptRight.x;
+			flat.y1 = seg->ptRight.y;
+		}
+		flat.child[0] = indexOf(node->_left);
+		flat.child[1] = indexOf(node->_right);
+		nodes.push_back(flat);
+	}
+}
+
+/**
+ * QueryScalar method
+ * Reference one-point-at-a-time walk over the flattened DAG
+ */
+void FlatDag::queryScalar(const Point* pts, int n, int* leaves) const
+{
+	queryFlatScalar(nodes.data(), root, pts, n, leaves);
+}
+
+// exact walk of one point, also used for lanes the float filter cannot decide
+static int queryOne(const FlatNode* nodes, int root, Point p)
+{
+	int cur = root;
+	while (cur >= 0)
+	{
+		const FlatNode& node = nodes[cur];
+		cur = node.child[orient2d(node.x0, node.y0, node.x1, node.y1, p.x, p.y) > 0 ? 0 : 1];
+	}
+	return ~cur;
+}
+
+void queryFlatScalar(const FlatNode* nodes, int root, const Point* pts, int n, int* leaves)
+{
+	for (int i = 0; i < n; ++i) leaves[i] = queryOne(nodes, root, pts[i]);
+}
+
+/**
+ * AVX2 kernel: 8 queries walk the DAG in lockstep
+ * Every step gathers the node fields of all lanes, evaluates the 8 line
+ * tests at once in float and blends in the chosen children. Lanes that
+ * reached a leaf keep their (negative) index and re-read node 0 harmlessly.
+ * A lane whose determinant does not clear ORIENT_BOUND_F is parked on a leaf
+ * and walked again with the exact predicate, so results match queryOne().
+ */
+__attribute__((target("avx2")))
+static void queryAvx2(const FlatNode* nodes, int root, const Point* pts, int n, int* leaves)
+{
+	const float* base = reinterpret_cast<const float*>(nodes);
+	const int* ibase = reinterpret_cast<const int*>(nodes);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i none = _mm256_set1_epi32(-1);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 boundScale = _mm256_set1_ps(ORIENT_BOUND_F);
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		// de-interleave the x and y coordinates of 8 points
+		__m256i xyIdx = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+		const float* p = reinterpret_cast<const float*>(pts + i);
+		__m256 px = _mm256_i32gather_ps(p, xyIdx, 4);
+		__m256 py = _mm256_i32gather_ps(p + 1, xyIdx, 4);
+
+		__m256i cur = _mm256_set1_epi32(root);
+		__m256i retry = zero;
+		while (true)
+		{
+			__m256i active = _mm256_cmpgt_epi32(cur, none);
+			if (_mm256_testz_si256(active, active)) break;
+			__m256i off = _mm256_slli_epi32(_mm256_max_epi32(cur, zero), 3);
+			__m256 x0 = _mm256_i32gather_ps(base + 0, off, 4);
+			__m256 y0 = _mm256_i32gather_ps(base + 1, off, 4);
+			__m256 x1 = _mm256_i32gather_ps(base + 2, off, 4);
+			__m256 y1 = _mm256_i32gather_ps(base + 3, off, 4);
+			__m256i left = _mm256_i32gather_epi32(ibase + 4, off, 4);
+			__m256i right = _mm256_i32gather_epi32(ibase + 5, off, 4);
+			__m256 detLeft = _mm256_mul_ps(_mm256_sub_ps(x1, x0), _mm256_sub_ps(py, y0));
+			__m256 detRight = _mm256_mul_ps(_mm256_sub_ps(y1, y0), _mm256_sub_ps(px, x0));
+			__m256 det = _mm256_sub_ps(detLeft, detRight);
+			__m256 bound = _mm256_mul_ps(boundScale, _mm256_add_ps(_mm256_and_ps(detLeft, absMask),
+																	_mm256_and_ps(detRight, absMask)));
+			__m256 sure = _mm256_or_ps(_mm256_cmp_ps(det, bound, _CMP_GE_OQ),
+									   _mm256_cmp_ps(_mm256_sub_ps(_mm256_setzero_ps(), det), bound, _CMP_GE_OQ));
+			__m256i unsure = _mm256_andnot_si256(_mm256_castps_si256(sure), active);
+			retry = _mm256_or_si256(retry, unsure);
+			__m256i goLeft = _mm256_castps_si256(_mm256_cmp_ps(det, _mm256_setzero_ps(), _CMP_GT_OQ));
+			__m256i next = _mm256_blendv_epi8(_mm256_blendv_epi8(right, left, goLeft), none, unsure);
+			cur = _mm256_blendv_epi8(cur, next, active);
+		}
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(leaves + i), _mm256_xor_si256(cur, none));
+		for (int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(retry)); lanes; lanes &= lanes - 1)
+		{
+			int k = __builtin_ctz(lanes);
+			leaves[i + k] = queryOne(nodes, root, pts[i + k]);
+		}
+	}
+	queryFlatScalar(nodes, root, pts + i, n - i, leaves + i);
+}
+
+/**
+ * AVX-512 kernel: same walk and filter with 16 lanes and mask registers
+ */
+__attribute__((target("avx512f")))
+static void queryAvx512(const FlatNode* nodes, int root, const Point* pts, int n, int* leaves)
+{
+	const float* base = reinterpret_cast<const float*>(nodes);
+	const int* ibase = reinterpret_cast<const int*>(nodes);
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i none = _mm512_set1_epi32(-1);
+	const __m512i xyIdx = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+	const __m512 boundScale = _mm512_set1_ps(ORIENT_BOUND_F);
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		const float* p = reinterpret_cast<const float*>(pts + i);
+		__m512 px = _mm512_i32gather_ps(xyIdx, p, 4);
+		__m512 py = _mm512_i32gather_ps(xyIdx, p + 1, 4);
+
+		__m512i cur = _mm512_set1_epi32(root);
+		__mmask16 active, retry = 0;
+		while ((active = _mm512_cmpge_epi32_mask(cur, zero)))
+		{
+			__m512i off = _mm512_slli_epi32(_mm512_max_epi32(cur, zero), 3);
+			__m512 x0 = _mm512_i32gather_ps(off, base + 0, 4);
+			__m512 y0 = _mm512_i32gather_ps(off, base + 1, 4);
+			__m512 x1 = _mm512_i32gather_ps(off, base + 2, 4);
+			__m512 y1 = _mm512_i32gather_ps(off, base + 3, 4);
+			__m512i left = _mm512_i32gather_epi32(off, ibase + 4, 4);
+			__m512i right = _mm512_i32gather_epi32(off, ibase + 5, 4);
+			__m512 detLeft = _mm512_mul_ps(_mm512_sub_ps(x1, x0), _mm512_sub_ps(py, y0));
+			__m512 detRight = _mm512_mul_ps(_mm512_sub_ps(y1, y0), _mm512_sub_ps(px, x0));
+			__m512 det = _mm512_sub_ps(detLeft, detRight);
+			__m512 bound = _mm512_mul_ps(boundScale, _mm512_add_ps(_mm512_abs_ps(detLeft), _mm512_abs_ps(detRight)));
+			__mmask16 sure = _mm512_cmp_ps_mask(det, bound, _CMP_GE_OQ) |
+							 _mm512_cmp_ps_mask(_mm512_sub_ps(_mm512_setzero_ps(), det), bound, _CMP_GE_OQ);
+			__mmask16 unsure = active & ~sure;
+			retry |= unsure;
+			__mmask16 goLeft = _mm512_cmp_ps_mask(det, _mm512_setzero_ps(), _CMP_GT_OQ);
+			__m512i next = _mm512_mask_blend_epi32(unsure, _mm512_mask_blend_epi32(goLeft, right, left), none);
+			cur = _mm512_mask_blend_epi32(active, cur, next);
+		}
+		_mm512_storeu_si512(leaves + i, _mm512_xor_si512(cur, none));
+		for (unsigned lanes = retry; lanes; lanes &= lanes - 1)
+		{
+			int k = __builtin_ctz(lanes);
+			leaves[i + k] = queryOne(nodes, root, pts[i + k]);
+		}
+	}
+	queryFlatScalar(nodes, root, pts + i, n - i, leaves + i);
+}
+
+/**
+ * Query method
+ * Localizes n points, dispatching to the widest kernel the CPU supports
+ * @pts: Query points
+ * @n: Number of points
+ * @leaves: Output, index into trapezoids for every point
+ */
+void FlatDag::query(const Point* pts, int n, int* leaves) const
+{
+	queryFlat(nodes.data(), root, pts, n, leaves);
+}
+
+/**
+ * QueryFlat function
+ * Kernel dispatch on a raw FlatNode array, shared with mapped map images
+ * @nodes, @root: Flattened DAG
+ */
+void queryFlat(const FlatNode* nodes, int root, const Point* pts, int n, int* leaves)
+{
+	if (root < 0 || n <= 0)
+	{
+		queryFlatScalar(nodes, root, pts, n, leaves);
+		return;
+	}
+	if (__builtin_cpu_supports("avx512f")) queryAvx512(nodes, root, pts, n, leaves);
+	else if (__builtin_cpu_supports("avx2")) queryAvx2(nodes, root, pts, n, leaves);
+	else queryFlatScalar(nodes, root, pts, n, leaves);
+}
+
+void WindowScratch::next(size_t nodeCount, size_t leafCount)
+{
+	if (nodeMarks.size() < nodeCount) nodeMarks.resize(nodeCount, 0);
+	if (leafMarks.size() < leafCount) leafMarks.resize(leafCount, 0);
+	if (++stamp == 0)
+	{
+		// wrapped around: forget all marks
+		fill(nodeMarks.begin(), nodeMarks.end(), 0);
+		fill(leafMarks.begin(), leafMarks.end(), 0);
+		fill(idMarks.begin(), idMarks.end(), 0);
+		stamp = 1;
+	}
+	leaves.clear();
+}
+
+bool WindowScratch::firstId(int id)
+{
+	if ((size_t)id >= idMarks.size()) idMarks.resize(id + 1, 0);
+	if (idMarks[id] == stamp) return false;
+	idMarks[id] = stamp;
+	return true;
+}
+
+/**
+ * WindowFlat function
+ * Collects the leaves of a flattened DAG whose region may meet the closed
+ * box [lo, hi]: a node is followed on every side that a corner of the box
+ * takes, ties included. Nodes reached along several paths are walked once,
+ * so the cost is the number of nodes over the box, not of paths to them.
+ * @nodes, @root: Flattened DAG
+ * @scratch: Marks sized for the DAG by next(); the trapezoid indices found
+ * are left in scratch.leaves
+ */
+void windowFlat(const FlatNode* nodes, int root, Point lo, Point hi, WindowScratch& scratch)
+{
+	const Point corners[4] = {lo, Point(hi.x, lo.y), hi, Point(lo.x, hi.y)};
+	vector<int>& pending = scratch.pending;
+	pending.assign(1, root);
+	while (!pending.empty())
+	{
+		int cur = pending.back();
+		pending.pop_back();
+		uint32_t& mark = cur < 0 ? scratch.leafMarks[~cur] : scratch.nodeMarks[cur];
+		if (mark == scratch.stamp) continue;
+		mark = scratch.stamp;
+		if (cur < 0)
+		{
+			scratch.leaves.push_back(~cur);
+			continue;
+		}
+		const FlatNode& node = nodes[cur];
+		bool left = false, right = false;
+		for (const Point& c : corners)
+		{
+			int side = orient2d(node.x0, node.y0, node.x1, node.y1, c.x, c.y);
+			left = left || side >= 0;
+			right = right || side <= 0;
+		}
+		if (right) pending.push_back(node.child[1]);
+		if (left) pending.push_back(node.child[0]);
+	}
+}
+
+const char* FlatDag::kernelName() const
+{
+	if (__builtin_cpu_supports("avx512f")) return "avx512 x16";
+	if (__builtin_cpu_supports("avx2")) return "avx2 x8";
+	return "scalar";
+}
+
+/**
+ * Freeze method
+ * Flattens the finished DAG so that localizeBatch can be used.
+ * Must be called again after further addSegment calls.
+ */
+void TrapezoidMap::freeze()
+{
+	_flat.build(_rootNode);
+}
+
+/**
+ * LocalizeBatch method
+ * Batched equivalent of localize() on the frozen map
+ * @pts: Query points
+ * @n: Number of points
+ * @out: Output, trapezoid containing every point
+ */
+void TrapezoidMap::localizeBatch(const Point* pts, int n, const Trapezoid** out)
+{
+	vector<int> leaves(n);
+	_flat.query(pts, n, leaves.data());
+	for (int i = 0; i < n; ++i) out[i] = _flat.trapezoids[leaves[i]];
+}
+
+/**
+ * WindowQuery method
+ * Finds the segments meeting a window, e.g. for drawing a viewport
+ * @lo, @hi: Lower left and upper right corners of the closed window
+ * @out: Output, one segment (piece) per input id, in no particular order
+ * Every segment meeting the window bounds a trapezoid meeting it, so the
+ * tops and bottoms of the trapezoids found by windowFlat() are tested
+ * exactly with meetsBox(). The descent only visits the nodes whose region
+ * meets the window, not all segments. Freezes the map on first use.
+ * Visited nodes and ids are marked in _window, which is reused from one
+ * query to the next, so one thread at a time queries a map.
+ */
+void TrapezoidMap::windowQuery(Point lo, Point hi, vector<const Segment*>& out)
+{
+	out.clear();
+	if (!_rootNode) return;
+	if (_flat.trapezoids.empty()) freeze();
+	_window.next(_flat.nodes.size(), _flat.trapezoids.size());
+	windowFlat(_flat.nodes.data(), _flat.root, lo, hi, _window);
+	for (int leaf : _window.leaves)
+	{
+		Trapezoid* tp = _flat.trapezoids[leaf];
+		for (Segment* seg : {tp->top, tp->bot})
+			if (seg->id >= 0 && seg->meetsBox(lo, hi) && _window.firstId(seg->id)) out.push_back(seg);
+	}
+}
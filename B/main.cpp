@@ -1,7 +1,537 @@
 #include "structures.h"
+#include "result_writer.h"
 
-int main()
+/**
+ * Benchmark of point location queries
+ * Times localize() over uniformly distributed points in the bounding box,
+ * from the DAG root, through the entry-node grid and through the batched
+ * SIMD kernel on the flattened DAG
+ * @map: Built trapezoid map
+ * @queries: Number of random queries
+ * @nx, @ny: Grid size to compare against
+ */
+void benchQueries(TrapezoidMap& map, int queries, int nx, int ny)
 {
+	mt19937 rng(12345);
+	uniform_real_distribution<float> distX(map._boxMin.x, map._boxMax.x);
+	uniform_real_distribution<float> distY(map._boxMin.y, map._boxMax.y);
+	vector<Point> pts(queries);
+	for (auto& p : pts) p = Point(distX(rng), distY(rng));
+
+	vector<const Trapezoid*> plain(queries), gridded(queries);
+	map.buildGrid(0, 0);
+	auto t0 = chrono::steady_clock::now();
+	for (int i = 0; i < queries; ++i) plain[i] = map.localize(pts[i]);
+	auto t1 = chrono::steady_clock::now();
+	map.buildGrid(nx, ny);
+	auto t2 = chrono::steady_clock::now();
+	for (int i = 0; i < queries; ++i) gridded[i] = map.localize(pts[i]);
+	auto t3 = chrono::steady_clock::now();
+
+	vector<const Trapezoid*> batched(queries);
+	map.freeze();
+	auto t4 = chrono::steady_clock::now();
+	map.localizeBatch(pts.data(), queries, batched.data());
+	auto t5 = chrono::steady_clock::now();
+
+	double plainNs = chrono::duration<double, nano>(t1 - t0).count() / queries;
+	double gridNs = chrono::duration<double, nano>(t3 - t2).count() / queries;
+	double batchNs = chrono::duration<double, nano>(t5 - t4).count() / queries;
+	cout << "grid " << nx << "x" << ny << " (" << map._grid.size() * sizeof(GraphNode*) << " bytes)" << endl;
+	cout << "root walk " << plainNs << " ns/query, grid entry " << gridNs << " ns/query"
+		 << (plain == gridded ? "" : "  [MISMATCH]") << endl;
+	cout << "batched " << map._flat.kernelName() << " " << batchNs << " ns/query ("
+		 << plainNs / batchNs << "x over root walk)"
+		 << (plain == batched ? "" : "  [MISMATCH]") << endl;
+}
+
+/**
+ * Benchmark of the strip-parallel build
+ * Times buildMapParallel() for 1 .. maxStrips strips against buildMap(), and
+ * checks that random queries find the same top and bottom segments
+ * @segments: Input segments
+ * @maxStrips: Largest number of strips (threads) to try
+ */
+void benchBuild(const vector<Segment>& segments, int maxStrips)
+{
+	mt19937 rng(12345);
+	uniform_real_distribution<float> dist(-100, 100);
+	vector<Point> pts(10000);
+	for (auto& p : pts) p = Point(dist(rng), dist(rng));
+
+	vector<Segment> input = segments;
+	TrapezoidMap sequential;
+	auto t0 = chrono::steady_clock::now();
+	sequential.buildMap(input);
+	auto t1 = chrono::steady_clock::now();
+	double baseMs = chrono::duration<double, milli>(t1 - t0).count();
+	cout << "sequential build " << baseMs << " ms" << endl;
+
+	for (int strips = 1; strips <= maxStrips; ++strips)
+	{
+		TrapezoidMap map;
+		auto t2 = chrono::steady_clock::now();
+		map.buildMapParallel(segments, strips);
+		auto t3 = chrono::steady_clock::now();
+		double ms = chrono::duration<double, milli>(t3 - t2).count();
+
+		int mismatches = 0;
+		for (const auto& p : pts)
+		{
+			const Trapezoid* a = sequential.localize(p);
+			const Trapezoid* b = map.localize(p);
+			if (a->top->id != b->top->id || a->bot->id != b->bot->id) ++mismatches;
+		}
+		cout << map._strips.size() << " strips " << ms << " ms (" << baseMs / ms << "x)"
+			 << (mismatches ? "  [" + to_string(mismatches) + " MISMATCHES]" : "") << endl;
+	}
+}
+
+/**
+ * Benchmark of the crossing split
+ * Times splitCrossings() and buildMap() on its pieces (the raw input cannot
+ * be built when segments cross)
+ * @segments: Input segments, possibly crossing
+ */
+void benchSplit(const vector<Segment>& segments)
+{
+	auto t0 = chrono::steady_clock::now();
+	long long splits = 0;
+	vector<Segment> pieces = splitCrossings(segments, &splits);
+	auto t1 = chrono::steady_clock::now();
+	TrapezoidMap map;
+	map.buildMap(pieces);
+	auto t2 = chrono::steady_clock::now();
+	double splitMs = chrono::duration<double, milli>(t1 - t0).count();
+	double buildMs = chrono::duration<double, milli>(t2 - t1).count();
+	cout << segments.size() << " segments, " << splits << " splits, " << pieces.size() << " pieces" << endl;
+	cout << "split " << splitMs << " ms, build on pieces " << buildMs << " ms (split adds "
+		 << 100 * splitMs / buildMs << "% to the build)" << endl;
+}
+
+/**
+ * Benchmark of the window query
+ * Times windowQuery() on random windows of 1/32 and 1/256 of the box per
+ * side against testing every segment of _segments with meetsBox(), and
+ * checks both find the same ids
+ * @map: Built trapezoid map
+ * @queries: Number of random windows of each size
+ */
+void benchWindow(TrapezoidMap& map, int queries)
+{
+	map.freeze();
+	for (int parts : {32, 256})
+	{
+		mt19937 rng(13579);
+		float w = (map._boxMax.x - map._boxMin.x) / parts, h = (map._boxMax.y - map._boxMin.y) / parts;
+		uniform_real_distribution<float> distX(map._boxMin.x, map._boxMax.x - w);
+		uniform_real_distribution<float> distY(map._boxMin.y, map._boxMax.y - h);
+		vector<Point> los(queries);
+		for (auto& p : los) p = Point(distX(rng), distY(rng));
+
+		vector<vector<int>> dagIds(queries), scanIds(queries);
+		vector<const Segment*> found;
+		auto t0 = chrono::steady_clock::now();
+		for (int i = 0; i < queries; ++i)
+		{
+			map.windowQuery(los[i], Point(los[i].x + w, los[i].y + h), found);
+			for (const Segment* seg : found) dagIds[i].push_back(seg->id);
+		}
+		auto t1 = chrono::steady_clock::now();
+		for (int i = 0; i < queries; ++i)
+		{
+			for (Segment& seg : map._segments)
+				if (seg.id >= 0 && seg.meetsBox(los[i], Point(los[i].x + w, los[i].y + h))) scanIds[i].push_back(seg.id);
+		}
+		auto t2 = chrono::steady_clock::now();
+		long long hits = 0;
+		for (int i = 0; i < queries; ++i)
+		{
+			sort(dagIds[i].begin(), dagIds[i].end());
+			sort(scanIds[i].begin(), scanIds[i].end());
+			scanIds[i].erase(unique(scanIds[i].begin(), scanIds[i].end()), scanIds[i].end());
+			hits += dagIds[i].size();
+		}
+
+		double dagUs = chrono::duration<double, micro>(t1 - t0).count() / queries;
+		double scanUs = chrono::duration<double, micro>(t2 - t1).count() / queries;
+		cout << "window 1/" << parts << ": " << (double)hits / queries << " segments/window, DAG descent " << dagUs
+			 << " us/window, scan " << scanUs << " us/window (" << scanUs / dagUs << "x)"
+			 << (dagIds == scanIds ? "" : "  [MISMATCH]") << endl;
+	}
+}
+
+/**
+ * Benchmark of the segment walk
+ * Times walkSegment() on random query segments of 1/32 of the box in length
+ * against testing every segment of _segments for a proper crossing, and
+ * checks both find the same ids
+ * @map: Built trapezoid map
+ * @queries: Number of random query segments
+ */
+void benchWalk(TrapezoidMap& map, int queries)
+{
+	mt19937 rng(97531);
+	float len = (map._boxMax.x - map._boxMin.x) / 32;
+	uniform_real_distribution<float> distX(map._boxMin.x + len, map._boxMax.x - len);
+	uniform_real_distribution<float> distY(map._boxMin.y + len, map._boxMax.y - len);
+	uniform_real_distribution<float> angle(0, 2 * M_PI);
+	vector<Segment> paths;
+	for (int i = 0; i < queries; ++i)
+	{
+		Point a(distX(rng), distY(rng));
+		float t = angle(rng);
+		paths.push_back(Segment(a, Point(a.x + len * cos(t), a.y + len * sin(t))));
+	}
+
+	vector<vector<int>> walkIds(queries), scanIds(queries);
+	vector<const Trapezoid*> passed;
+	vector<const Segment*> crossed;
+	long long steps = 0;
+	auto t0 = chrono::steady_clock::now();
+	for (int i = 0; i < queries; ++i)
+	{
+		map.walkSegment(paths[i], passed, crossed);
+		steps += passed.size();
+		for (const Segment* seg : crossed) walkIds[i].push_back(seg->id);
+	}
+	auto t1 = chrono::steady_clock::now();
+	for (int i = 0; i < queries; ++i)
+	{
+		Segment& q = paths[i];
+		for (Segment& seg : map._segments)
+		{
+			if (seg.id < 0) continue;
+			if (seg.orient(q.ptLeft) * seg.orient(q.ptRight) < 0 && q.orient(seg.ptLeft) * q.orient(seg.ptRight) < 0)
+				scanIds[i].push_back(seg.id);
+		}
+	}
+	auto t2 = chrono::steady_clock::now();
+	int mismatches = 0;
+	long long hits = 0;
+	for (int i = 0; i < queries; ++i)
+	{
+		sort(walkIds[i].begin(), walkIds[i].end());
+		sort(scanIds[i].begin(), scanIds[i].end());
+		scanIds[i].erase(unique(scanIds[i].begin(), scanIds[i].end()), scanIds[i].end());
+		mismatches += walkIds[i] != scanIds[i];
+		hits += walkIds[i].size();
+	}
+
+	double walkUs = chrono::duration<double, micro>(t1 - t0).count() / queries;
+	double scanUs = chrono::duration<double, micro>(t2 - t1).count() / queries;
+	cout << "walk: " << (double)hits / queries << " crossings, " << (double)steps / queries << " trapezoids per query, walk "
+		 << walkUs << " us/query, scan " << scanUs << " us/query (" << scanUs / walkUs << "x)";
+	if (mismatches) cout << "  [MISMATCH " << mismatches << "]";
+	cout << endl;
+}
+
+/**
+ * Benchmark of snapshot queries during edits
+ * Inserts the edit segments one epoch each while reader threads localize
+ * random points in random published epochs and one more thread walks
+ * random paths through the latest epoch. Readers go on for a few more
+ * batches after the last edit, so every epoch gets pinned, then a sample
+ * of their answers is checked against a scan of the segments of their
+ * epochs. Built with ThreadSanitizer (make check-snapshots) it also checks
+ * that readers, walker and editor share the map without a data race
+ * @map: Map built serially from the other segments
+ * @edits: Segments to insert, meeting the map's only at shared endpoints
+ * @readers: Reader threads
+ * Returns 1 if a sampled answer disagrees with the scan or the samples
+ * cover fewer than two epochs
+ */
+int benchSnapshots(TrapezoidMap& map, vector<Segment>& edits, int readers)
+{
+	struct Sample
+	{
+		Point pt;
+		int epoch, top, bot;
+	};
+	const size_t keep = 256; // samples per reader
+	const int lateBatches = 64; // batches per reader after the last edit
+	atomic<bool> done(false), edited(false);
+	atomic<int> running(0); // edits start once every thread runs
+	atomic<int> settled(0); // readers done with their late batches
+	vector<long long> located(readers, 0);
+	vector<vector<Sample>> samples(readers);
+	vector<thread> pool;
+	auto t0 = chrono::steady_clock::now();
+	for (int r = 0; r < readers; ++r)
+	{
+		pool.emplace_back([&, r]()
+		{
+			mt19937 rng(2468 + r);
+			uniform_real_distribution<float> distX(map._boxMin.x, map._boxMax.x);
+			uniform_real_distribution<float> distY(map._boxMin.y, map._boxMax.y);
+			long long seen = 0;
+			int late = 0;
+			++running;
+			while (!done.load(memory_order_relaxed))
+			{
+				// pin an epoch among the published ones for a batch of queries
+				int epoch = uniform_int_distribution<int>(0, map.epoch())(rng);
+				for (int i = 0; i < 256; ++i)
+				{
+					Point pt(distX(rng), distY(rng));
+					EpochTrapezoid tr = map.localizeAt(pt, epoch);
+					if (i > 0) continue;
+					// reservoir sample over the whole run
+					Sample sample = {pt, epoch, tr.top->id, tr.bot->id};
+					if (samples[r].size() < keep) samples[r].push_back(sample);
+					else if (rng() % (seen + 1) < keep) samples[r][rng() % keep] = sample;
+					++seen;
+				}
+				located[r] += 256;
+				if (edited.load(memory_order_relaxed) && ++late == lateBatches) ++settled;
+			}
+		});
+	}
+	// the walk takes the edit lock, so it runs between insertions and
+	// yields after each one to let a waiting insertion have the lock
+	long long walks = 0;
+	pool.emplace_back([&]()
+	{
+		mt19937 rng(1357);
+		uniform_real_distribution<float> distX(map._boxMin.x, map._boxMax.x);
+		uniform_real_distribution<float> distY(map._boxMin.y, map._boxMax.y);
+		vector<const Trapezoid*> passed;
+		vector<const Segment*> crossed;
+		++running;
+		while (!done.load(memory_order_relaxed))
+		{
+			map.walkSegment(Segment(Point(distX(rng), distY(rng)), Point(distX(rng), distY(rng))), passed, crossed);
+			++walks;
+			this_thread::yield();
+		}
+	});
+	while (running < readers + 1) this_thread::yield();
+	auto t1 = chrono::steady_clock::now();
+	for (const Segment& seg : edits) map.insertSegment(seg);
+	auto t2 = chrono::steady_clock::now();
+	edited = true;
+	while (settled < readers) this_thread::yield();
+	done = true;
+	for (auto& reader : pool) reader.join();
+	auto t3 = chrono::steady_clock::now();
+
+	// segments just above and below a point in an epoch, by scan
+	auto scan = [&](const Sample& sample, int& top, int& bot)
+	{
+		float yTop = 0, yBot = 0;
+		top = bot = -1;
+		auto consider = [&](Segment& seg)
+		{
+			Point pt = sample.pt;
+			if (seg.id < 0 || seg.vertical || !(seg.ptLeft.x < pt.x && pt.x < seg.ptRight.x)) return;
+			int side = seg.orient(pt);
+			float y = seg.ptWithX(pt.x).y;
+			if (side < 0 && (top < 0 || y < yTop)) { top = seg.id; yTop = y; }
+			if (side > 0 && (bot < 0 || y > yBot)) { bot = seg.id; yBot = y; }
+		};
+		for (Segment& seg : map._segments) consider(seg);
+		for (int k = 0; k < sample.epoch; ++k) consider(edits[k]);
+	};
+	int checked = 0, mismatches = 0;
+	set<int> epochs;
+	for (auto& kept : samples)
+		for (const Sample& sample : kept)
+		{
+			int top, bot;
+			scan(sample, top, bot);
+			++checked;
+			mismatches += top != sample.top || bot != sample.bot;
+			epochs.insert(sample.epoch);
+		}
+
+	long long total = accumulate(located.begin(), located.end(), 0LL);
+	double editSeconds = chrono::duration<double>(t2 - t1).count();
+	double readSeconds = chrono::duration<double>(t3 - t0).count();
+	cout << "snapshots: " << edits.size() << " edits in " << editSeconds * 1e3 << " ms ("
+		 << edits.size() / max(editSeconds, 1e-9) << " edits/s) while " << readers << " readers localized "
+		 << total << " points (" << total / readSeconds << " points/s) and a walker followed " << walks << " paths" << endl;
+	cout << "checked " << checked << " answers over " << epochs.size() << " epochs against a scan";
+	if (mismatches) cout << "  [MISMATCH " << mismatches << "]";
+	if (epochs.size() < 2) cout << "  [TOO FEW EPOCHS]";
+	cout << endl;
+	return mismatches || epochs.size() < 2 ? 1 : 0;
+}
+
+/**
+ * Memory report for the compact representation
+ * Prints bytes per input segment of the pointer-based map and of the
+ * CompactMap built from it, and checks that both localize random points to
+ * the same trapezoid
+ * @map: Built map
+ * @inputSegments: Number of input segments
+ */
+void reportMemory(TrapezoidMap& map, size_t inputSegments)
+{
+	CompactMap compact;
+	compact.build(map);
+	size_t before = map.pointerBytes();
+	size_t after = compact.bytes();
+	double n = max<size_t>(inputSegments, 1);
+	cout << map._flat.trapezoids.size() << " trapezoids, " << map._flat.nodes.size() << " inner DAG nodes" << endl;
+	cout << "pointer map " << before / n << " bytes/segment, compact " << after / n << " bytes/segment ("
+		 << (double)before / after << "x smaller)" << endl;
+
+	mt19937 rng(12345);
+	uniform_real_distribution<float> distX(map._boxMin.x, map._boxMax.x);
+	uniform_real_distribution<float> distY(map._boxMin.y, map._boxMax.y);
+	int mismatches = 0;
+	for (int i = 0; i < 100000; ++i)
+	{
+		Point p(distX(rng), distY(rng));
+		if (map._flat.trapezoids[compact.localize(p)] != map.localize(p)) ++mismatches;
+	}
+	if (mismatches) cout << mismatches << " MISMATCHES" << endl;
+}
+
+/**
+ * Answers queries from a map image instead of building the map
+ * @path: Image written with --save
+ * Standard input holds only the query points, one per line. The output has
+ * the same format as a normal run; echoed segments are the image's segments.
+ */
+int answerFromImage(const char* path, bool binary, bool echo)
+{
+	MappedMap image;
+	if (!image.open(path))
+	{
+		cerr << "cannot map image " << path << endl;
+		return 1;
+	}
+	vector<Point> queries;
+	float xq, yq;
+	while (cin >> xq >> yq) queries.push_back(Point(xq, yq));
+	vector<int> leaves(queries.size());
+	image.localizeBatch(queries.data(), queries.size(), leaves.data());
+
+	ResultWriter out;
+	out.open(binary ? "data.bin" : "data.txt", binary);
+	if (binary)
+	{
+		for (size_t i = 0; i < queries.size(); ++i)
+		{
+			const ImageTrapezoid& tr = image.trapezoids[leaves[i]];
+			int record[4] = {(int)i, leaves[i], image.segments[tr.top].id, image.segments[tr.bot].id};
+			out.record(record, 4);
+		}
+		return 0;
+	}
+	if (echo)
+	{
+		for (uint32_t i = 0; i < image.header->segmentCount; ++i)
+		{
+			const ImageSegment& seg = image.segments[i];
+			if (seg.id < 0) continue;
+			out.line("SEG %g %g %g %g\n", seg.ptLeft.x, seg.ptLeft.y, seg.ptRight.x, seg.ptRight.y);
+		}
+	}
+	for (size_t i = 0; i < queries.size(); ++i)
+	{
+		const ImageTrapezoid& tr = image.trapezoids[leaves[i]];
+		const ImageSegment& top = image.segments[tr.top];
+		const ImageSegment& bot = image.segments[tr.bot];
+		out.line("TRAP_TOP %g %g %g %g\n", top.ptLeft.x, top.ptLeft.y, top.ptRight.x, top.ptRight.y);
+		out.line("TRAP_BOT %g %g %g %g\n", bot.ptLeft.x, bot.ptLeft.y, bot.ptRight.x, bot.ptRight.y);
+		out.line("TRAP_LEFT %g %g\n", tr.left.x, tr.left.y);
+		out.line("TRAP_RIGHT %g %g\n", tr.right.x, tr.right.y);
+		out.line("QUERY %g %g\n", queries[i].x, queries[i].y);
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	// Optional flags: --grid NX NY (entry-node grid), --bench Q (time Q random queries),
+	// --threads T (build T strips in parallel), --bench-build T (time builds with 1..T strips),
+	// --format text|binary (results file), --echo 0|1 (copy input segments to data.txt),
+	// --save PATH (write a map image), --load PATH (answer queries from a map image),
+	// --memory (bytes per segment of the pointer map and the compact map),
+	// --faces (label faces and report the face of every query),
+	// --split (cut crossing segments first), --bench-split (time the split against the build),
+	// --external PATH (out-of-core build into a map image, then answer from it),
+	// --budget MB (peak RSS target of --external, default 256),
+	// --window (pair up query points as window corners), --bench-window Q (time Q window queries),
+	// --walk (pair up query points as query segments), --bench-walk Q (time Q segment walks),
+	// --serve PATH (answer requests on a Unix socket, from --load/--external images too),
+	// --workers W (server threads, default one per core),
+	// --loadgen PATH (drive a server) with --connections C --requests R --batch B --depth D,
+	// --edits K (insert the last K segments after the build, one edit epoch each),
+	// --epoch E (answer the queries as of edit epoch E),
+	// --bench-snapshots R (R readers query old epochs while the edits land)
+	int gridX = 0, gridY = 0, bench = 0, threads = 1, benchBuildThreads = 0, benchWindowQueries = 0;
+	int benchWalkQueries = 0, workers = max(1u, thread::hardware_concurrency());
+	int connections = 4, requests = 10000, batch = 1, depth = 1;
+	int edits = 0, queryEpoch = -1, snapshotReaders = 0;
+	bool binary = false, echo = true, memory = false, faces = false, split = false, benchSplitOnly = false;
+	bool window = false, walk = false;
+	const char* savePath = nullptr;
+	const char* loadPath = nullptr;
+	const char* externalPath = nullptr;
+	const char* servePath = nullptr;
+	const char* loadgenPath = nullptr;
+	size_t budgetMb = 256;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--grid" && i + 2 < argc) { gridX = atoi(argv[++i]); gridY = atoi(argv[++i]); }
+		else if (arg == "--bench" && i + 1 < argc) bench = atoi(argv[++i]);
+		else if (arg == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (arg == "--bench-build" && i + 1 < argc) benchBuildThreads = atoi(argv[++i]);
+		else if (arg == "--format" && i + 1 < argc) binary = string(argv[++i]) == "binary";
+		else if (arg == "--echo" && i + 1 < argc) echo = atoi(argv[++i]) != 0;
+		else if (arg == "--save" && i + 1 < argc) savePath = argv[++i];
+		else if (arg == "--load" && i + 1 < argc) loadPath = argv[++i];
+		else if (arg == "--memory") memory = true;
+		else if (arg == "--faces") faces = true;
+		else if (arg == "--split") split = true;
+		else if (arg == "--bench-split") benchSplitOnly = true;
+		else if (arg == "--external" && i + 1 < argc) externalPath = argv[++i];
+		else if (arg == "--budget" && i + 1 < argc) budgetMb = atoi(argv[++i]);
+		else if (arg == "--window") window = true;
+		else if (arg == "--bench-window" && i + 1 < argc) benchWindowQueries = atoi(argv[++i]);
+		else if (arg == "--walk") walk = true;
+		else if (arg == "--bench-walk" && i + 1 < argc) benchWalkQueries = atoi(argv[++i]);
+		else if (arg == "--serve" && i + 1 < argc) servePath = argv[++i];
+		else if (arg == "--workers" && i + 1 < argc) workers = atoi(argv[++i]);
+		else if (arg == "--loadgen" && i + 1 < argc) loadgenPath = argv[++i];
+		else if (arg == "--connections" && i + 1 < argc) connections = atoi(argv[++i]);
+		else if (arg == "--requests" && i + 1 < argc) requests = atoi(argv[++i]);
+		else if (arg == "--batch" && i + 1 < argc) batch = atoi(argv[++i]);
+		else if (arg == "--depth" && i + 1 < argc) depth = atoi(argv[++i]);
+		else if (arg == "--edits" && i + 1 < argc) edits = atoi(argv[++i]);
+		else if (arg == "--epoch" && i + 1 < argc) queryEpoch = atoi(argv[++i]);
+		else if (arg == "--bench-snapshots" && i + 1 < argc) snapshotReaders = atoi(argv[++i]);
+	}
+	ios::sync_with_stdio(false);
+	cin.tie(nullptr);
+
+	if (loadgenPath) return runLoadgen(loadgenPath, connections, requests, batch, depth);
+	if (externalPath)
+	{
+		if (!buildExternal(cin, externalPath, budgetMb << 20))
+		{
+			cerr << "external build into " << externalPath << " failed" << endl;
+			return 1;
+		}
+		if (!servePath) return answerFromImage(externalPath, binary, echo);
+		loadPath = externalPath;
+	}
+	if (loadPath && servePath)
+	{
+		MappedMap image;
+		if (!image.open(loadPath))
+		{
+			cerr << "cannot map image " << loadPath << endl;
+			return 1;
+		}
+		return serveImage(image, servePath, workers);
+	}
+	if (loadPath) return answerFromImage(loadPath, binary, echo);
+
 	TrapezoidMap map;
 	std::vector<Segment> segments;
 	int N;
@@ -10,31 +540,173 @@ int main()
     {
         float x1, y1, x2, y2;
         std::cin >> x1 >> y1 >> x2 >> y2;
-        segments.emplace_back(Point(x1, y1), Point(x2, y2));
+        segments.emplace_back(Point(x1, y1), Point(x2, y2), i);
     }
+	// one query point per line until end of input
+	vector<Point> queries;
 	float xq, yq;
-    cin >> xq >> yq;
-    Point queryPoint(xq, yq);
+    while (cin >> xq >> yq) queries.push_back(Point(xq, yq));
 
-	map.buildMap(segments);
+	if (benchSplitOnly)
+	{
+		benchSplit(segments);
+		return 0;
+	}
+	if (split) segments = splitCrossings(segments);
 
-	const Trapezoid* tr = map.localize(queryPoint);
+	if (benchBuildThreads > 0)
+	{
+		benchBuild(segments, benchBuildThreads);
+		return 0;
+	}
 
-	ofstream out("data.txt");
+	// the pieces of the last edits input segments are inserted after the build
+	vector<Segment> edited;
+	if (edits > 0)
+	{
+		int firstEdit = N - min(edits, N);
+		auto mid = stable_partition(segments.begin(), segments.end(), [firstEdit](const Segment& seg) { return seg.id < firstEdit; });
+		edited.assign(mid, segments.end());
+		segments.erase(mid, segments.end());
+		if (threads > 1) cerr << "--edits needs a serial build, ignoring --threads" << endl;
+		threads = 1;
+	}
 
-	for (const auto& seg : segments)
-    {
-        out << "SEG " << seg.ptLeft.x << " " << seg.ptLeft.y << " "<< seg.ptRight.x << " " << seg.ptRight.y << "\n";
-    }
+	if (threads > 1) map.buildMapParallel(segments, threads);
+	else map.buildMap(segments);
+
+	if (snapshotReaders > 0)
+	{
+		return benchSnapshots(map, edited, snapshotReaders);
+	}
+	for (const Segment& seg : edited) map.insertSegment(seg);
+
+	if (savePath && !map.save(savePath))
+	{
+		cerr << "cannot write " << savePath << endl;
+		return 1;
+	}
+
+	if (servePath) return serveMap(map, servePath, workers);
+
+	if (memory)
+	{
+		reportMemory(map, segments.size());
+		return 0;
+	}
+	if (bench > 0)
+	{
+		benchQueries(map, bench, gridX > 0 ? gridX : 64, gridY > 0 ? gridY : 64);
+		return 0;
+	}
+	if (benchWindowQueries > 0)
+	{
+		benchWindow(map, benchWindowQueries);
+		return 0;
+	}
+	if (benchWalkQueries > 0)
+	{
+		benchWalk(map, benchWalkQueries);
+		return 0;
+	}
+
+	ResultWriter out;
+	out.open(binary ? "data.bin" : "data.txt", binary);
+
+	if (faces) map.labelFaces();
+
+	if (binary && !window && !walk)
+	{
+		// records of (query index, trapezoid index, top segment id, bottom segment id),
+		// followed by the face id with --faces; an older epoch is not frozen, so
+		// its trapezoids have no index (-1)
+		vector<int> leaves(queries.size(), -1);
+		if (queryEpoch < 0)
+		{
+			map.freeze();
+			map._flat.query(queries.data(), queries.size(), leaves.data());
+		}
+		for (size_t i = 0; i < queries.size(); ++i)
+		{
+			EpochTrapezoid tr = queryEpoch < 0 ? EpochTrapezoid(*map._flat.trapezoids[leaves[i]])
+											   : map.localizeAt(queries[i], queryEpoch);
+			int record[5] = {(int)i, leaves[i], tr.top->id, tr.bot->id, tr.face};
+			out.record(record, faces ? 5 : 4);
+		}
+		return 0;
+	}
+	map.buildGrid(gridX, gridY);
+
+	if (echo)
+	{
+		for (const auto& seg : segments)
+		{
+			out.line("SEG %g %g %g %g\n", seg.ptLeft.x, seg.ptLeft.y, seg.ptRight.x, seg.ptRight.y);
+		}
+		for (const auto& seg : edited)
+		{
+			out.line("SEG %g %g %g %g\n", seg.ptLeft.x, seg.ptLeft.y, seg.ptRight.x, seg.ptRight.y);
+		}
+	}
 
-    out << "TRAP_TOP " << tr->top->ptLeft.x << " " << tr->top->ptLeft.y << " "<< tr->top->ptRight.x << " " << tr->top->ptRight.y << "\n";
-    out << "TRAP_BOT " << tr->bot->ptLeft.x << " " << tr->bot->ptLeft.y << " "<< tr->bot->ptRight.x << " " << tr->bot->ptRight.y << "\n";
-    out << "TRAP_LEFT " << tr->left.x << " " << tr->left.y << "\n";
-    out << "TRAP_RIGHT " << tr->right.x << " " << tr->right.y << "\n";
+	if (window)
+	{
+		// every two query points are opposite corners of a window; the text
+		// output lists the segments met before each WINDOW line, the binary
+		// output holds one (window index, segment id) record per segment
+		vector<const Segment*> found;
+		for (size_t i = 0; i + 1 < queries.size(); i += 2)
+		{
+			Point lo(min(queries[i].x, queries[i + 1].x), min(queries[i].y, queries[i + 1].y));
+			Point hi(max(queries[i].x, queries[i + 1].x), max(queries[i].y, queries[i + 1].y));
+			map.windowQuery(lo, hi, found);
+			for (const Segment* seg : found)
+			{
+				int record[2] = {(int)(i / 2), seg->id};
+				out.record(record, 2);
+				out.line("HIT %g %g %g %g\n", seg->ptLeft.x, seg->ptLeft.y, seg->ptRight.x, seg->ptRight.y);
+			}
+			out.line("WINDOW %g %g %g %g\n", lo.x, lo.y, hi.x, hi.y);
+		}
+		return 0;
+	}
 
-    out << "QUERY " << queryPoint.x << " " << queryPoint.y << "\n";
+	if (walk)
+	{
+		// every two query points are the ends of a query segment; the text
+		// output lists the segments crossed, the faces entered with --faces
+		// and the number of trapezoids passed before each WALK line, the
+		// binary output holds one (walk index, segment id) record per crossing
+		vector<const Trapezoid*> passed;
+		vector<const Segment*> crossed;
+		for (size_t i = 0; i + 1 < queries.size(); i += 2)
+		{
+			Segment path(queries[i], queries[i + 1]);
+			map.walkSegment(path, passed, crossed);
+			for (const Segment* seg : crossed)
+			{
+				int record[2] = {(int)(i / 2), seg->id};
+				out.record(record, 2);
+				out.line("CROSS %g %g %g %g\n", seg->ptLeft.x, seg->ptLeft.y, seg->ptRight.x, seg->ptRight.y);
+			}
+			for (size_t j = 0; faces && j < passed.size(); ++j)
+				if (j == 0 || passed[j]->face != passed[j - 1]->face) out.line("FACE %d\n", passed[j]->face);
+			out.line("TRAPEZOIDS %d\n", (int)passed.size());
+			out.line("WALK %g %g %g %g\n", path.ptLeft.x, path.ptLeft.y, path.ptRight.x, path.ptRight.y);
+		}
+		return 0;
+	}
 
-    out.close();
+	for (const Point& queryPoint : queries)
+	{
+		EpochTrapezoid tr = queryEpoch >= 0 ? map.localizeAt(queryPoint, queryEpoch) : EpochTrapezoid(*map.localize(queryPoint));
+		out.line("TRAP_TOP %g %g %g %g\n", tr.top->ptLeft.x, tr.top->ptLeft.y, tr.top->ptRight.x, tr.top->ptRight.y);
+		out.line("TRAP_BOT %g %g %g %g\n", tr.bot->ptLeft.x, tr.bot->ptLeft.y, tr.bot->ptRight.x, tr.bot->ptRight.y);
+		out.line("TRAP_LEFT %g %g\n", tr.left.x, tr.left.y);
+		out.line("TRAP_RIGHT %g %g\n", tr.right.x, tr.right.y);
+		if (faces) out.line("FACE %d\n", tr.face);
+		out.line("QUERY %g %g\n", queryPoint.x, queryPoint.y);
+	}
 
     return 0;
 }
@@ -0,0 +1,209 @@
+#include "structures.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint64_t alignUp(uint64_t offset)
+{
+	return (offset + 63) & ~(uint64_t)63;
+}
+
+/**
+ * Save method
+ * Freezes the map and writes it as a map image
+ * @path: Output file
+ * Segments are the ones referenced by trapezoids (clipped pieces for a
+ * strip build, plus the bounding box); trapezoids are numbered as in the
+ * flattened DAG, so leaf indices of the FlatNodes stay valid.
+ */
+bool TrapezoidMap::save(const char* path)
+{
+	this->freeze();
+
+	unordered_map<const Segment*, int> segIndex;
+	vector<ImageSegment> segs;
+	auto indexOfSeg = [&](const Segment* seg)
+	{
+		auto it = segIndex.find(seg);
+		if (it != segIndex.end()) return it->second;
+		ImageSegment rec = ImageSegment();
+		rec.ptLeft = seg->ptLeft;
+		rec.ptRight = seg->ptRight;
+		rec.id = seg->id;
+		segs.push_back(rec);
+		return segIndex[seg] = segs.size() - 1;
+	};
+
+	unordered_map<const Trapezoid*, int> trIndex;
+	for (size_t i = 0; i < _flat.trapezoids.size(); ++i) trIndex[_flat.trapezoids[i]] = i;
+	auto indexOfTr = [&](const Trapezoid* tp)
+	{
+		auto it = tp ? trIndex.find(tp) : trIndex.end();
+		return it == trIndex.end() ? -1 : it->second;
+	};
+
+	vector<ImageTrapezoid> trs;
+	for (const Trapezoid* tp : _flat.trapezoids)
+	{
+		ImageTrapezoid rec;
+		rec.top = indexOfSeg(tp->top);
+		rec.bot = indexOfSeg(tp->bot);
+		rec.left = tp->left;
+		rec.right = tp->right;
+		rec.trLeftTop = indexOfTr(tp->trLeftTop);
+		rec.trLeftBot = indexOfTr(tp->trLeftBot);
+		rec.trRightTop = indexOfTr(tp->trRightTop);
+		rec.trRightBot = indexOfTr(tp->trRightBot);
+		trs.push_back(rec);
+	}
+
+	ImageHeader header = ImageHeader();
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.version = IMAGE_VERSION;
+	header.root = _flat.root;
+	header.segmentCount = segs.size();
+	header.trapezoidCount = trs.size();
+	header.nodeCount = _flat.nodes.size();
+	header.boxMin = _boxMin;
+	header.boxMax = _boxMax;
+	header.segmentOffset = alignUp(sizeof(ImageHeader));
+	header.trapezoidOffset = alignUp(header.segmentOffset + segs.size() * sizeof(ImageSegment));
+	header.nodeOffset = alignUp(header.trapezoidOffset + trs.size() * sizeof(ImageTrapezoid));
+	header.fileSize = header.nodeOffset + _flat.nodes.size() * sizeof(FlatNode);
+
+	vector<char> image(header.fileSize, 0);
+	memcpy(image.data(), &header, sizeof(header));
+	memcpy(image.data() + header.segmentOffset, segs.data(), segs.size() * sizeof(ImageSegment));
+	memcpy(image.data() + header.trapezoidOffset, trs.data(), trs.size() * sizeof(ImageTrapezoid));
+	memcpy(image.data() + header.nodeOffset, _flat.nodes.data(), _flat.nodes.size() * sizeof(FlatNode));
+
+	FILE* file = fopen(path, "wb");
+	if (!file) return false;
+	bool ok = fwrite(image.data(), 1, image.size(), file) == image.size();
+	return fclose(file) == 0 && ok;
+}
+
+/**
+ * Image check
+ * Every array must lie inside the file at an aligned offset and every
+ * index must point into its array, or a corrupt image would send a walk
+ * or a lookup out of the mapping; extents are compared by division, so no
+ * sum can wrap. The DAG below the root must also be free of cycles, so
+ * every walk ends.
+ */
+static bool fitsIn(uint64_t offset, uint64_t count, size_t size, size_t fileSize)
+{
+	return offset <= fileSize && offset % 8 == 0 && count <= (fileSize - offset) / size;
+}
+
+static bool validImage(const ImageHeader* header, const char* bytes, size_t size)
+{
+	if (!fitsIn(header->segmentOffset, header->segmentCount, sizeof(ImageSegment), size) ||
+		!fitsIn(header->trapezoidOffset, header->trapezoidCount, sizeof(ImageTrapezoid), size) ||
+		!fitsIn(header->nodeOffset, header->nodeCount, sizeof(FlatNode), size))
+		return false;
+	auto isChild = [header](int child)
+	{
+		return child >= 0 ? (uint32_t)child < header->nodeCount : (uint32_t)~child < header->trapezoidCount;
+	};
+	auto isLink = [header](int32_t link) {return link == -1 || (link >= 0 && (uint32_t)link < header->trapezoidCount);};
+	if (!isChild(header->root)) return false;
+
+	const ImageTrapezoid* trapezoids = reinterpret_cast<const ImageTrapezoid*>(bytes + header->trapezoidOffset);
+	for (uint32_t i = 0; i < header->trapezoidCount; ++i)
+	{
+		const ImageTrapezoid& tr = trapezoids[i];
+		if ((uint32_t)tr.top >= header->segmentCount || (uint32_t)tr.bot >= header->segmentCount ||
+			!isLink(tr.trLeftTop) || !isLink(tr.trLeftBot) || !isLink(tr.trRightTop) || !isLink(tr.trRightBot))
+			return false;
+	}
+	const FlatNode* nodes = reinterpret_cast<const FlatNode*>(bytes + header->nodeOffset);
+	for (uint32_t i = 0; i < header->nodeCount; ++i)
+		if (!isChild(nodes[i].child[0]) || !isChild(nodes[i].child[1])) return false;
+	if (header->root < 0) return true;
+
+	// depth-first from the root; meeting a node still on the path is a cycle
+	vector<char> state(header->nodeCount, 0); // 1 on the path, 2 finished
+	vector<pair<int, int>> path(1, make_pair(header->root, 0));
+	state[header->root] = 1;
+	while (!path.empty())
+	{
+		int node = path.back().first, k = path.back().second++;
+		if (k == 2)
+		{
+			state[node] = 2;
+			path.pop_back();
+			continue;
+		}
+		int child = nodes[node].child[k];
+		if (child < 0 || state[child] == 2) continue;
+		if (state[child] == 1) return false;
+		state[child] = 1;
+		path.push_back(make_pair(child, 0));
+	}
+	return true;
+}
+
+/**
+ * Open method
+ * Maps a map image read-only and checks its header, extents and indices
+ * @path: Image written by TrapezoidMap::save()
+ */
+bool MappedMap::open(const char* path)
+{
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageHeader))
+	{
+		::close(fd);
+		return false;
+	}
+	void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED) return false;
+	_base = base;
+	_size = st.st_size;
+
+	const char* bytes = static_cast<const char*>(_base);
+	header = reinterpret_cast<const ImageHeader*>(bytes);
+	if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != IMAGE_VERSION ||
+		header->fileSize != _size || !validImage(header, bytes, _size))
+	{
+		close();
+		return false;
+	}
+	segments = reinterpret_cast<const ImageSegment*>(bytes + header->segmentOffset);
+	trapezoids = reinterpret_cast<const ImageTrapezoid*>(bytes + header->trapezoidOffset);
+	nodes = reinterpret_cast<const FlatNode*>(bytes + header->nodeOffset);
+	return true;
+}
+
+void MappedMap::close()
+{
+	if (_base) munmap(_base, _size);
+	_base = nullptr;
+	_size = 0;
+	header = nullptr;
+	segments = nullptr;
+	trapezoids = nullptr;
+	nodes = nullptr;
+}
+
+/**
+ * Localize method
+ * Same walk as FlatDag on the mapped nodes
+ */
+int MappedMap::localize(Point pt) const
+{
+	int leaf;
+	queryFlatScalar(nodes, header->root, &pt, 1, &leaf);
+	return leaf;
+}
+
+void MappedMap::localizeBatch(const Point* pts, int n, int* out) const
+{
+	queryFlat(nodes, header->root, pts, n, out);
+}
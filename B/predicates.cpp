@@ -0,0 +1,50 @@
+#include "predicates.h"
+
+// x + y == a + b exactly, x = fl(a + b)
+static inline void twoSum(double a, double b, double& x, double& y)
+{
+	x = a + b;
+	double bv = x - a;
+	double av = x - bv;
+	y = (a - av) + (b - bv);
+}
+
+// x + y == a * b exactly, x = fl(a * b)
+static inline void twoProduct(double a, double b, double& x, double& y)
+{
+	x = a * b;
+	y = fma(a, b, -x);
+}
+
+/**
+ * Exact orientation
+ * Expands the determinant into six products, splits each into two doubles
+ * and accumulates them into a nonoverlapping expansion (Shewchuk's
+ * Grow-Expansion with zero elimination). The last component has the largest
+ * magnitude, so its sign is the sign of the sum.
+ */
+int orient2dExact(double ax, double ay, double bx, double by, double cx, double cy)
+{
+	const double terms[6][2] = {{bx, cy}, {-bx, ay}, {-ax, cy}, {-by, cx}, {by, ax}, {ay, cx}};
+	double e[12];
+	int m = 0;
+	for (int t = 0; t < 6; ++t)
+	{
+		double part[2];
+		twoProduct(terms[t][0], terms[t][1], part[1], part[0]);
+		for (double b : part)
+		{
+			double q = b, h;
+			int k = 0;
+			for (int i = 0; i < m; ++i)
+			{
+				twoSum(q, e[i], q, h);
+				if (h != 0) e[k++] = h;
+			}
+			if (q != 0) e[k++] = q;
+			m = k;
+		}
+	}
+	if (m == 0) return 0;
+	return (e[m - 1] > 0) - (e[m - 1] < 0);
+}
@@ -0,0 +1,31 @@
+#ifndef PREDICATES_H
+#define PREDICATES_H
+
+#include <cfloat>
+#include <cmath>
+
+/**
+ * Robust orientation predicate
+ * orient2d() returns the sign of (bx - ax) * (cy - ay) - (by - ay) * (cx - ax):
+ * +1 if c lies left of (above) the directed line a -> b, -1 if right, 0 if on it.
+ * The determinant is first evaluated in double precision; the result is used
+ * when it clears Shewchuk's error bound, otherwise orient2dExact() recomputes
+ * the sign with floating-point expansions, which never fails.
+ * ORIENT_BOUND_F is the same bound for a filter evaluated in float
+ */
+const double ORIENT_BOUND = (3.0 + 8.0 * DBL_EPSILON) * (DBL_EPSILON / 2);
+const float ORIENT_BOUND_F = (3.0f + 8.0f * FLT_EPSILON) * (FLT_EPSILON / 2);
+
+int orient2dExact(double ax, double ay, double bx, double by, double cx, double cy);
+
+inline int orient2d(double ax, double ay, double bx, double by, double cx, double cy)
+{
+	double detLeft = (bx - ax) * (cy - ay);
+	double detRight = (by - ay) * (cx - ax);
+	double det = detLeft - detRight;
+	double bound = ORIENT_BOUND * (fabs(detLeft) + fabs(detRight));
+	if (det >= bound || -det >= bound) return (det > 0) - (det < 0);
+	return orient2dExact(ax, ay, bx, by, cx, cy);
+}
+
+#endif
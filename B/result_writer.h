@@ -0,0 +1,81 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <vector>
+
+/**
+ * ResultWriter class
+ * Buffered writer for the results file
+ * Text lines are formatted straight into one reusable buffer (%g prints
+ * like ostream's default) and the buffer is written out only when full or
+ * on close, never per line.
+ * In binary mode the file holds fixed-size records of 32-bit ints and text
+ * lines are dropped.
+ */
+class ResultWriter
+{
+public:
+	bool binary;
+
+	ResultWriter(): binary(false), _file(nullptr), _used(0), _buffer(1 << 20) {}
+	~ResultWriter() {close();}
+
+	bool open(const char* path, bool binaryRecords)
+	{
+		close();
+		binary = binaryRecords;
+		_file = fopen(path, "wb");
+		if (_file) setvbuf(_file, nullptr, _IONBF, 0);
+		return _file != nullptr;
+	}
+
+	// append a printf-formatted text line
+	void line(const char* fmt, ...)
+	{
+		if (!_file || binary) return;
+		for (int attempt = 0; attempt < 2; ++attempt)
+		{
+			va_list args;
+			va_start(args, fmt);
+			size_t room = _buffer.size() - _used;
+			int len = vsnprintf(_buffer.data() + _used, room, fmt, args);
+			va_end(args);
+			if (len < 0) return;
+			if ((size_t)len < room)
+			{
+				_used += len;
+				return;
+			}
+			flush();
+			if ((size_t)len >= _buffer.size()) _buffer.resize(len + 1);
+		}
+	}
+
+	// append one binary record of n ints
+	void record(const int* fields, int n)
+	{
+		if (!_file || !binary) return;
+		size_t bytes = n * sizeof(int);
+		if (_buffer.size() - _used < bytes) flush();
+		memcpy(_buffer.data() + _used, fields, bytes);
+		_used += bytes;
+	}
+
+	void flush()
+	{
+		if (_file && _used) fwrite(_buffer.data(), 1, _used, _file);
+		_used = 0;
+	}
+
+	void close()
+	{
+		flush();
+		if (_file) fclose(_file);
+		_file = nullptr;
+	}
+
+private:
+	FILE* 				_file;
+	size_t 				_used;
+	std::vector<char> 	_buffer;
+};
@@ -0,0 +1,386 @@
+#include "structures.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// bytes taken from a connection per wakeup
+static const size_t SERVER_READ_CHUNK = 1 << 16;
+
+/**
+ * Index a server answers from: the flattened DAG of a built map or the
+ * nodes of a mapped image, with the segment ids of their trapezoids
+ */
+struct ServedIndex
+{
+	const FlatNode* 			nodes;
+	int 						root;
+	const vector<Trapezoid*>* 	trapezoids; // built map, or
+	const MappedMap* 			image; // mapped image
+
+	void answer(const Point* pts, int n, vector<int>& leaves, ServerAnswer* out) const
+	{
+		leaves.resize(n);
+		queryFlat(nodes, root, pts, n, leaves.data());
+		for (int i = 0; i < n; ++i)
+		{
+			out[i].trapezoid = leaves[i];
+			if (image)
+			{
+				const ImageTrapezoid& tr = image->trapezoids[leaves[i]];
+				out[i].top = image->segments[tr.top].id;
+				out[i].bot = image->segments[tr.bot].id;
+			}
+			else
+			{
+				const Trapezoid* tr = (*trapezoids)[leaves[i]];
+				out[i].top = tr->top->id;
+				out[i].bot = tr->bot->id;
+			}
+		}
+	}
+};
+
+// bytes of responses a connection may have queued before it is no longer read
+static const size_t SERVER_OUTPUT_CAP = 1 << 20;
+// bytes of one partial request a connection may hold: the largest frame
+static const size_t SERVER_INPUT_CAP = sizeof(FrameHeader) + SERVER_MAX_BATCH * sizeof(Point);
+
+static bool setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/**
+ * Connection struct
+ * State of one client of a worker: the bytes of a partial request, the
+ * responses not yet written (from sent on) and the epoll events it waits for
+ */
+struct Connection
+{
+	vector<char> 	input;
+	vector<char> 	output;
+	size_t 			sent = 0;
+	uint32_t 		events = EPOLLIN;
+	bool 			eof = false; // the client has shut down its side
+
+	size_t queued() const {return output.size() - sent;}
+};
+
+/**
+ * Write queued responses until the socket is full
+ * Returns false if the connection failed
+ */
+static bool flushOutput(int fd, Connection& conn)
+{
+	while (conn.queued() > 0)
+	{
+		ssize_t n = send(fd, conn.output.data() + conn.sent, conn.queued(), MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n <= 0) return false;
+		conn.sent += n;
+	}
+	if (conn.sent == conn.output.size())
+	{
+		conn.output.clear();
+		conn.sent = 0;
+	}
+	return true;
+}
+
+/**
+ * Server worker
+ * Owns the connections registered in its epoll set; their sockets are
+ * non-blocking. Every wakeup reads one chunk of what a connection has sent,
+ * answers all the complete requests in its buffer with one batched descent
+ * and queues their responses, so a pipelining client gets its requests
+ * batched for free. Partial requests wait in the buffer for the next read.
+ * Responses go out as the socket takes them, the rest on EPOLLOUT. While
+ * more than SERVER_OUTPUT_CAP bytes are queued the connection is not read,
+ * so a client that stops reading holds back only itself.
+ */
+static void serveWorker(const ServedIndex* index, int epfd)
+{
+	unordered_map<int, Connection> connections;
+	vector<char> chunk(SERVER_READ_CHUNK);
+	vector<FrameHeader> frames;
+	vector<Point> pts;
+	vector<int> leaves;
+	vector<ServerAnswer> answers;
+	epoll_event events[64];
+	while (true)
+	{
+		int ready = epoll_wait(epfd, events, 64, -1);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready < 0) return;
+		for (int e = 0; e < ready; ++e)
+		{
+			int fd = events[e].data.fd;
+			Connection& conn = connections[fd];
+			bool bad = (events[e].events & EPOLLERR) != 0;
+
+			if (!bad && !conn.eof && conn.queued() < SERVER_OUTPUT_CAP && (events[e].events & (EPOLLIN | EPOLLHUP)))
+			{
+				size_t room = min(chunk.size(), SERVER_INPUT_CAP - conn.input.size());
+				ssize_t got = recv(fd, chunk.data(), room, 0);
+				if (got == 0) conn.eof = true;
+				else if (got < 0) bad = errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK;
+				else conn.input.insert(conn.input.end(), chunk.data(), chunk.data() + got);
+			}
+
+			vector<char>& buf = conn.input;
+			size_t pos = 0;
+			frames.clear();
+			pts.clear();
+			while (!bad && buf.size() - pos >= sizeof(FrameHeader))
+			{
+				FrameHeader head;
+				memcpy(&head, &buf[pos], sizeof(head));
+				if (head.count > SERVER_MAX_BATCH)
+				{
+					bad = true;
+					break;
+				}
+				size_t size = sizeof(head) + (size_t)head.count * sizeof(Point);
+				if (buf.size() - pos < size) break;
+				pts.resize(pts.size() + head.count);
+				memcpy(pts.data() + pts.size() - head.count, &buf[pos + sizeof(head)], head.count * sizeof(Point));
+				frames.push_back(head);
+				pos += size;
+			}
+			buf.erase(buf.begin(), buf.begin() + pos);
+
+			if (!frames.empty())
+			{
+				answers.resize(pts.size());
+				index->answer(pts.data(), pts.size(), leaves, answers.data());
+				const ServerAnswer* next = answers.data();
+				for (const FrameHeader& head : frames)
+				{
+					const char* h = (const char*)&head;
+					const char* a = (const char*)next;
+					conn.output.insert(conn.output.end(), h, h + sizeof(head));
+					conn.output.insert(conn.output.end(), a, a + head.count * sizeof(ServerAnswer));
+					next += head.count;
+				}
+			}
+			bad = bad || !flushOutput(fd, conn);
+
+			if (bad || (conn.eof && conn.queued() == 0))
+			{
+				// closing the socket also drops it from the epoll set
+				connections.erase(fd);
+				close(fd);
+				continue;
+			}
+			uint32_t wanted = (conn.queued() > 0 ? EPOLLOUT : 0) |
+							  (!conn.eof && conn.queued() < SERVER_OUTPUT_CAP ? EPOLLIN : 0);
+			if (wanted != conn.events)
+			{
+				epoll_event event = epoll_event();
+				event.events = wanted;
+				event.data.fd = fd;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event);
+				conn.events = wanted;
+			}
+		}
+	}
+}
+
+static char servedPath[sizeof(sockaddr_un::sun_path)];
+
+static void stopServer(int)
+{
+	unlink(servedPath);
+	_exit(0);
+}
+
+/**
+ * Accept loop of the server
+ * Listens on socketPath (a stale socket file is replaced) and hands each
+ * connection to the next of the worker threads in turn. SIGINT and SIGTERM
+ * remove the socket file and exit.
+ */
+static int serve(const ServedIndex& index, const char* socketPath, int workers)
+{
+	sockaddr_un addr = sockaddr_un();
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path))
+	{
+		cerr << "socket path too long: " << socketPath << endl;
+		return 1;
+	}
+	strcpy(addr.sun_path, socketPath);
+	strcpy(servedPath, socketPath);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath);
+	if (listener < 0 || ::bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 128) < 0)
+	{
+		cerr << "cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+		return 1;
+	}
+	signal(SIGINT, stopServer);
+	signal(SIGTERM, stopServer);
+
+	workers = max(workers, 1);
+	vector<int> epfds;
+	vector<thread> pool;
+	for (int w = 0; w < workers; ++w)
+	{
+		epfds.push_back(epoll_create1(0));
+		pool.emplace_back(serveWorker, &index, epfds.back());
+	}
+	cerr << "serving on " << socketPath << " with " << workers << " workers" << endl;
+	for (int turn = 0; ; turn = (turn + 1) % workers)
+	{
+		int fd = accept(listener, nullptr, nullptr);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			cerr << "accept failed: " << strerror(errno) << endl;
+			break;
+		}
+		if (!setNonBlocking(fd))
+		{
+			close(fd);
+			continue;
+		}
+		epoll_event event = epoll_event();
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		epoll_ctl(epfds[turn], EPOLL_CTL_ADD, fd, &event);
+	}
+	unlink(socketPath);
+	_exit(1); // the workers never return
+}
+
+/**
+ * ServeMap
+ * Serves a built map from its flattened DAG
+ */
+int serveMap(TrapezoidMap& map, const char* socketPath, int workers)
+{
+	map.freeze();
+	ServedIndex index = {map._flat.nodes.data(), map._flat.root, &map._flat.trapezoids, nullptr};
+	return serve(index, socketPath, workers);
+}
+
+/**
+ * ServeImage
+ * Serves a mapped image in place; every worker reads the same pages
+ */
+int serveImage(const MappedMap& image, const char* socketPath, int workers)
+{
+	ServedIndex index = {image.nodes, image.header->root, nullptr, &image};
+	return serve(index, socketPath, workers);
+}
+
+/**
+ * Load generator
+ * Opens connections to a server, each driven by its own thread, and sends
+ * requests of batch random points in the default box. Each connection keeps
+ * depth requests in flight and sends a new one whenever a response arrives.
+ * Latency is measured from sending a request to reading its whole response.
+ * @requests: Requests per connection
+ * A connection writes its requests and reads its responses as the socket
+ * allows, so any depth and batch size can be in flight.
+ */
+int runLoadgen(const char* socketPath, int connections, int requests, int batch, int depth)
+{
+	sockaddr_un addr = sockaddr_un();
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+	batch = max(1, min(batch, (int)SERVER_MAX_BATCH));
+	depth = max(depth, 1);
+
+	vector<vector<double>> latencies(connections);
+	atomic<int> failures(0);
+	vector<thread> clients;
+	auto t0 = chrono::steady_clock::now();
+	for (int c = 0; c < connections; ++c)
+	{
+		clients.emplace_back([&, c]()
+		{
+			int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+			{
+				++failures;
+				if (fd >= 0) close(fd);
+				return;
+			}
+			mt19937 rng(1234 + c);
+			uniform_real_distribution<float> coord(-100, 100);
+			vector<char> request(sizeof(FrameHeader) + batch * sizeof(Point));
+			vector<char> response(sizeof(FrameHeader) + batch * sizeof(ServerAnswer));
+			vector<chrono::steady_clock::time_point> sentAt(requests);
+			size_t requestPos = request.size(), responsePos = 0; // bytes of each written or read so far
+			int sent = 0, received = 0;
+			bool ok = setNonBlocking(fd);
+			while (ok && received < requests)
+			{
+				if (requestPos == request.size() && sent < requests && sent - received < depth)
+				{
+					FrameHeader head = {(uint32_t)sent, (uint32_t)batch};
+					memcpy(request.data(), &head, sizeof(head));
+					Point* pts = (Point*)(request.data() + sizeof(head));
+					for (int i = 0; i < batch; ++i) pts[i] = Point(coord(rng), coord(rng));
+					sentAt[sent++] = chrono::steady_clock::now();
+					requestPos = 0;
+				}
+				// write the request and read responses as the socket allows, so neither side waits on the other
+				pollfd pfd = {fd, (short)(POLLIN | (requestPos < request.size() ? POLLOUT : 0)), 0};
+				if (poll(&pfd, 1, -1) < 0)
+				{
+					ok = errno == EINTR;
+					continue;
+				}
+				if (pfd.revents & POLLOUT)
+				{
+					ssize_t n = send(fd, request.data() + requestPos, request.size() - requestPos, MSG_NOSIGNAL);
+					if (n > 0) requestPos += n;
+					else ok = n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+				}
+				if (ok && (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+				{
+					ssize_t n = recv(fd, response.data() + responsePos, response.size() - responsePos, 0);
+					if (n > 0) responsePos += n;
+					else ok = n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+				}
+				if (ok && responsePos == response.size())
+				{
+					FrameHeader head;
+					memcpy(&head, response.data(), sizeof(head));
+					ok = head.tag == (uint32_t)received && head.count == (uint32_t)batch;
+					if (ok) latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sentAt[received++]).count());
+					responsePos = 0;
+				}
+			}
+			if (!ok) ++failures;
+			close(fd);
+		});
+	}
+	for (auto& client : clients) client.join();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+	vector<double> all;
+	for (auto& lat : latencies) all.insert(all.end(), lat.begin(), lat.end());
+	if (all.empty())
+	{
+		cerr << "no responses from " << socketPath << endl;
+		return 1;
+	}
+	sort(all.begin(), all.end());
+	auto pct = [&](double p) { return all[min(all.size() - 1, (size_t)(p * all.size()))]; };
+	cout << "loadgen: " << connections << " connections, batch " << batch << ", depth " << depth << ": "
+		 << all.size() / seconds << " requests/s, " << all.size() * batch / seconds << " points/s, latency p50 "
+		 << pct(0.5) << " us, p99 " << pct(0.99) << " us, p99.9 " << pct(0.999) << " us";
+	if (failures) cout << "  [FAILED " << failures << " connections]";
+	cout << endl;
+	return failures ? 1 : 0;
+}
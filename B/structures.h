@@ -1,4 +1,5 @@
 #include <bits/stdc++.h>
+#include "predicates.h"
 using namespace std;
 
 /**
@@ -17,35 +18,57 @@ struct Point
  * and to get x/y coordinates based on y/x coordinates
  * isAbove() checks if a point is above the segment
  * ptWithX() returns the point in the segment with x-coordinate x
- * detHelper() calculates the determinant for checking the position of a point relative to the segment
+ * orient() is the exact side of a point: +1 above the segment's line, -1 below, 0 on it
+ * meetsBox() tells exactly whether the segment meets a closed axis-aligned box
+ * slope is precomputed once so ptWithX() needs no division; a vertical
+ * segment gets slope 0
+ * id is the index of the input segment (-1 for the bounding box), shared by
+ * all pieces of a segment clipped into strips
  */
 struct Segment
 {
 	Point ptLeft;
 	Point ptRight;
-	Segment(Point pt1, Point pt2): ptLeft(pt1), ptRight(pt2) 
+	float slope;
+	bool vertical;
+	int id;
+	Segment(Point pt1, Point pt2, int id = -1): ptLeft(pt1), ptRight(pt2), id(id)
 	{
 		if  (ptLeft.x >  ptRight.x || (ptLeft.x == ptRight.x && ptLeft.y > ptRight.y)) swap(ptLeft, ptRight);
+		vertical = (ptLeft.x == ptRight.x);
+		slope = vertical ? 0.0f : (ptRight.y - ptLeft.y) / (ptRight.x - ptLeft.x);
 	}
-	float detHelper(Point p)
+	int orient(Point p)
 	{
-		return ((ptRight.x - ptLeft.x) * (p.y - ptLeft.y) - 
-				(ptRight.y - ptLeft.y) * (p.x - ptLeft.x));
+		return orient2d(ptLeft.x, ptLeft.y, ptRight.x, ptRight.y, p.x, p.y);
 	}
 	bool isAbove(Point pTarget, Point pGuide)
 	{
-		// find if target point is above break ties (numerical zeros) with pGuide
-		float EPS = 0.1;
-		float det = this->detHelper(pTarget);
-		return (fabsf(det) > EPS) ? det > 0 : this->detHelper(pGuide) > 0;
+		// find if target point is above, break exact ties (point on the line) with pGuide
+		int side = this->orient(pTarget);
+		return side != 0 ? side > 0 : this->orient(pGuide) > 0;
 	}
 	Point ptWithX(float x)
 	{
 		// find point in the segment with x-cord x
-		float y = ptLeft.y + (ptRight.y - ptLeft.y) / (ptRight.x - ptLeft.x) * (x - ptLeft.x);
+		float y = ptLeft.y + slope * (x - ptLeft.x);
 		return Point(x, y);
 	}
 
+	bool meetsBox(Point lo, Point hi)
+	{
+		// the bounding boxes overlap and the corners are not all strictly on one side
+		if (ptRight.x < lo.x || ptLeft.x > hi.x || maxY() < lo.y || minY() > hi.y) return false;
+		int sides[4] = {orient(lo), orient(hi), orient(Point(lo.x, hi.y)), orient(Point(hi.x, lo.y))};
+		bool above = false, below = false;
+		for (int side : sides)
+		{
+			above = above || side >= 0;
+			below = below || side <= 0;
+		}
+		return above && below;
+	}
+
 	float 	minY() 	{return std::min(ptLeft.y, ptRight.y);}
 	float 	maxY() 	{return std::max(ptLeft.y, ptRight.y);}
 
@@ -74,9 +97,12 @@ struct Trapezoid
 	// corresponding node in DAG
 	GraphNode* graphNode;
 
+	// face of the subdivision, set by TrapezoidMap::labelFaces() (-1 before)
+	int face;
+
 	Trapezoid(): trRightBot(nullptr), trRightTop(nullptr),
 				 trLeftTop(nullptr), trLeftBot(nullptr),
-				 graphNode(nullptr){}
+				 graphNode(nullptr), face(-1){}
 
 	/**
 	 * Setters for trapezoid
@@ -126,7 +152,28 @@ struct Trapezoid
 	}
 };
 
+/**
+ * EpochTrapezoid structure
+ * A trapezoid as localizeAt() reports it for an edit epoch: the fields that
+ * never change once the trapezoid is published. Its neighbour links are
+ * rewritten by later edits, so they are not part of it
+ */
+struct EpochTrapezoid
+{
+	const Segment* 	top;
+	const Segment* 	bot;
+	Point 			left;
+	Point 			right;
+	int 			face;
+
+	EpochTrapezoid(const Trapezoid& tr): top(tr.top), bot(tr.bot), left(tr.left), right(tr.right), face(tr.face) {}
+};
+
+
 
+// DAG links are written by one editor while snapshot readers follow them
+template <class T> inline T* loadAcquire(T* const& slot) {return __atomic_load_n(&slot, __ATOMIC_ACQUIRE);}
+template <class T> inline void storeRelease(T*& slot, T* value) {__atomic_store_n(&slot, value, __ATOMIC_RELEASE);}
 
 class GraphNode 
 {
@@ -135,10 +182,16 @@ public:
 	GraphNode* _right;
 	//list<GraphNode*> _parents;
 	vector<GraphNode*> _parents;
-	GraphNode(): _left(nullptr), _right(nullptr) {}
+	// a node that replaced a leaf keeps the edit epoch that made it and the
+	// leaf, which readers of older epochs take instead (0 and nullptr otherwise)
+	int 		_epoch;
+	GraphNode* 	_replaced;
+	GraphNode(): _left(nullptr), _right(nullptr), _epoch(0), _replaced(nullptr) {}
 	virtual ~GraphNode() {}
 	virtual Trapezoid* 	getTrapezoid() 			{return nullptr;}
 	virtual GraphNode* 	nextNode(Point,Point) 	{return nullptr;}
+	// child taken by every point of the box [lo, hi], nullptr if the box is split
+	virtual GraphNode* 	nextNodeBox(Point,Point) {return nullptr;}
 	
 	void attachLeft(GraphNode* node) 
 	{
@@ -154,20 +207,23 @@ public:
 		node->_parents.push_back(this);
 	}
 	
-	void replaceWith(GraphNode* node)
+	void replaceWith(GraphNode* node, int epoch)
 	{
-		// change urself with node
+		// change urself with node, which must be complete: a reader may
+		// follow it as soon as the first parent points to it
+		node->_epoch = epoch;
+		node->_replaced = this;
 		assert(!_parents.empty());
 		for (auto parent : _parents)
 		{
 			if (parent->_left == this)
 			{
-				parent->_left = node;
+				storeRelease(parent->_left, node);
 			}
 			else
 			{
 				assert(parent->_right == this);
-				parent->_right = node;
+				storeRelease(parent->_right, node);
 			}
 		}
 	}
@@ -181,7 +237,14 @@ public:
 
 	virtual GraphNode* nextNode(Point p,Point)
 	{
-		return (p.x < _point) ? _left : _right;
+		return loadAcquire((p.x < _point) ? _left : _right);
+	}
+
+	virtual GraphNode* nextNodeBox(Point lo, Point hi)
+	{
+		if (hi.x < _point) return _left;
+		if (lo.x >= _point) return _right;
+		return nullptr;
 	}
 };
 
@@ -193,7 +256,24 @@ public:
 
 	virtual GraphNode* nextNode(Point pTarget,Point pGuide)
 	{
-		return _segment->isAbove(pTarget,pGuide) ? _left : _right;
+		return loadAcquire(_segment->isAbove(pTarget,pGuide) ? _left : _right);
+	}
+
+	virtual GraphNode* nextNodeBox(Point lo, Point hi)
+	{
+		// every corner must be strictly on one side, so that no point of the
+		// box lies on the line and falls back to the guide point
+		int sides[4] = {_segment->orient(lo), _segment->orient(hi),
+						_segment->orient(Point(lo.x, hi.y)), _segment->orient(Point(hi.x, lo.y))};
+		bool above = true, below = true;
+		for (int side : sides)
+		{
+			above = above && side > 0;
+			below = below && side < 0;
+		}
+		if (above) return _left;
+		if (below) return _right;
+		return nullptr;
 	}
 };
 
@@ -206,13 +286,248 @@ public:
 	virtual Trapezoid* getTrapezoid() 	{return _trapezoid;}
 };
 
+/**
+ * Flattened DAG node
+ * Both node kinds are stored as one line test: the left child is taken when
+ * orient2d(x0, y0, x1, y1, p.x, p.y) > 0. A YNode keeps its segment's
+ * endpoints, so the test is exactly Segment::orient(); an XNode at x = c is
+ * stored as the upward line (c, 0) -> (c, 1), which is > 0 exactly when p.x < c.
+ * Children >= 0 index nodes, children < 0 are ~(index into the trapezoid list).
+ * 32 bytes, so two nodes share a cache line and fields can be gathered by index.
+ */
+struct FlatNode
+{
+	float x0, y0, x1, y1;
+	int child[2]; // [0] = left/above, [1] = right/below
+	int pad[2];
+};
+
+/**
+ * Frozen, pointer-free copy of the DAG used by the batched query kernel
+ */
+struct FlatDag
+{
+	vector<FlatNode> 	nodes;
+	vector<Trapezoid*> 	trapezoids;
+	int 				root; // node index, or ~trapezoid index if the DAG is a single leaf
+
+	FlatDag(): root(0) {}
+	void build(GraphNode* rootNode);
+	void query(const Point* pts, int n, int* leaves) const; // trapezoid indices for n points
+	void queryScalar(const Point* pts, int n, int* leaves) const;
+	const char* kernelName() const;
+};
+
+// batched walk over a raw FlatNode array, root as in FlatDag
+void queryFlat(const FlatNode* nodes, int root, const Point* pts, int n, int* leaves);
+void queryFlatScalar(const FlatNode* nodes, int root, const Point* pts, int n, int* leaves);
+
+/**
+ * Scratch space of window queries, reused from one query to the next
+ * A node, leaf or segment id is marked visited by storing the current stamp
+ * at its index, so nothing has to be cleared between queries
+ */
+struct WindowScratch
+{
+	vector<uint32_t> 	nodeMarks, leafMarks, idMarks;
+	uint32_t 			stamp;
+	vector<int> 		pending, leaves;
+
+	WindowScratch(): stamp(0) {}
+	void next(size_t nodeCount, size_t leafCount); // start a query over a DAG of this size
+	bool firstId(int id); // marks a segment id, true if the query had not seen it
+};
+void windowFlat(const FlatNode* nodes, int root, Point lo, Point hi, WindowScratch& scratch); // fills scratch.leaves
+
+/**
+ * Compact map
+ * Index-based copy of a finished map for memory-bound use
+ * Endpoints are stored once; segments and trapezoid left/right points refer
+ * to them by 32-bit index, and trapezoid neighbours and DAG children are
+ * 32-bit trapezoid/node indices. A DAG node is 12 bytes: ref >= 0 is a YNode
+ * on segment ref, ref < 0 an XNode at the x of point ~ref. Children follow
+ * FlatNode: >= 0 nodes, < 0 ~trapezoid index.
+ */
+struct CompactTrapezoid
+{
+	uint32_t top, bot; // segment indices
+	uint32_t left, right; // point indices
+	int32_t trLeftTop, trLeftBot, trRightTop, trRightBot; // -1 for none
+};
+
+struct CompactSegment
+{
+	uint32_t left, right; // point indices
+};
+
+struct CompactNode
+{
+	int32_t ref;
+	int32_t child[2]; // [0] = left/above, [1] = right/below
+};
+
+class TrapezoidMap;
+
+struct CompactMap
+{
+	vector<Point> 				points;
+	vector<CompactSegment> 		segments;
+	vector<int32_t> 			segmentIds; // input id per segment, -1 for the bounding box
+	vector<CompactTrapezoid> 	trapezoids;
+	vector<CompactNode> 		nodes;
+	int32_t 					root; // node index, or ~trapezoid index
+
+	CompactMap(): root(0) {}
+	void 	build(TrapezoidMap& map); // freezes map; trapezoids are numbered like its FlatDag
+	int 	localize(Point pt) const; // index of the trapezoid containing pt
+	size_t 	bytes() const;
+};
+
+/**
+ * Map image
+ * Relocatable file written by TrapezoidMap::save() and mapped by MappedMap:
+ * the header, then the segment, trapezoid and FlatNode arrays at 64-byte
+ * aligned offsets. Every reference is an array index, so the file works at
+ * any address and can be shared read-only between processes.
+ */
+const char IMAGE_MAGIC[8] = "TRAPMAP";
+const uint32_t IMAGE_VERSION = 2;
+
+struct ImageHeader
+{
+	char 		magic[8]; // "TRAPMAP"
+	uint32_t 	version;
+	int32_t 	root; // as in FlatDag
+	uint32_t 	segmentCount;
+	uint32_t 	trapezoidCount;
+	uint32_t 	nodeCount;
+	uint32_t 	pad;
+	Point 		boxMin;
+	Point 		boxMax;
+	uint64_t 	segmentOffset;
+	uint64_t 	trapezoidOffset;
+	uint64_t 	nodeOffset;
+	uint64_t 	fileSize;
+};
+
+struct ImageSegment
+{
+	Point 	ptLeft;
+	Point 	ptRight;
+	int32_t id; // input segment id, -1 for the bounding box
+	int32_t pad;
+};
+
+struct ImageTrapezoid
+{
+	int32_t top, bot; // segment indices
+	Point 	left, right;
+	int32_t trLeftTop, trLeftBot, trRightTop, trRightBot; // trapezoid indices, -1 for none
+};
+
+/**
+ * Read-only view of a map image
+ * localize() walks the mapped FlatNodes directly, nothing is copied
+ */
+class MappedMap
+{
+public:
+	const ImageHeader* 		header;
+	const ImageSegment* 	segments;
+	const ImageTrapezoid* 	trapezoids;
+	const FlatNode* 		nodes;
+
+	MappedMap(): header(nullptr), segments(nullptr), trapezoids(nullptr), nodes(nullptr), _base(nullptr), _size(0) {}
+	~MappedMap() {close();}
+
+	bool 	open(const char* path); // false if the file is missing or not an image
+	void 	close();
+	int 	localize(Point pt) const; // index of the trapezoid containing pt
+	void 	localizeBatch(const Point* pts, int n, int* out) const;
+
+private:
+	void* 	_base;
+	size_t 	_size;
+};
+
+/**
+ * Bentley–Ottmann preprocessing (crossings.cpp)
+ * splitCrossings() cuts crossing segments at their intersection points, so
+ * the pieces meet only at endpoints as buildMap() expects; every piece keeps
+ * the id of its input segment
+ */
+vector<Segment> splitCrossings(const vector<Segment>& segments, long long* splits = nullptr);
+
+/**
+ * Out-of-core build (external_build.cpp)
+ * buildExternal() reads "N" and N segments from in and writes a map image
+ * to path without holding the input or the whole map in memory; budget is
+ * the target peak RSS in bytes of any one step
+ */
+bool buildExternal(istream& in, const char* path, size_t budget);
+
+/**
+ * Query server (server.cpp)
+ * serveMap() and serveImage() answer point location requests on a Unix
+ * stream socket until killed. A request is a FrameHeader and count Points,
+ * its response a FrameHeader with the same tag and count ServerAnswers.
+ * Fields are native-endian. A client may send further requests before the
+ * responses arrive; they are answered in order on each connection.
+ * runLoadgen() drives a server and reports throughput and latency.
+ */
+const uint32_t SERVER_MAX_BATCH = 1 << 20; // a larger count closes the connection
+
+struct FrameHeader
+{
+	uint32_t tag; // chosen by the client, echoed in the response
+	uint32_t count; // points in the request, answers in the response
+};
+
+struct ServerAnswer
+{
+	int32_t trapezoid; // index in the flattened DAG or the image
+	int32_t top, bot; // input segment ids, -1 for the bounding box
+};
+
+int serveMap(TrapezoidMap& map, const char* socketPath, int workers); // freezes map
+int serveImage(const MappedMap& image, const char* socketPath, int workers);
+int runLoadgen(const char* socketPath, int connections, int requests, int batch, int depth);
+
 class TrapezoidMap
 {
 public:
 	GraphNode* 				_rootNode;
 	vector<Segment> 	    _segments;
 
-	TrapezoidMap():_rootNode(nullptr){}
+	// bounding box of the map
+	Point 					_boxMin;
+	Point 					_boxMax;
+
+	// optional uniform grid of DAG entry nodes, row-major _gridX * _gridY cells
+	vector<GraphNode*> 		_grid;
+	int 					_gridX;
+	int 					_gridY;
+
+	// flattened DAG for batched queries, filled by freeze()
+	FlatDag 				_flat;
+	WindowScratch 			_window; // marks of windowQuery()
+
+	// strip maps of a parallel build and the clipped segments they point into
+	vector<TrapezoidMap*> 	_strips;
+	vector<vector<Segment>> _stripSegments;
+
+	// vertical segments by x, then lower end, for walkSegment(); they lie
+	// on trapezoid walls and are never a top or bottom
+	vector<const Segment*> 	_verticals;
+
+	// edit epochs: 0 is the built map, insertSegment() publishes one more
+	// per segment; readers pinned to any published epoch run lock-free
+	atomic<int> 			_published;
+	int 					_editEpoch; // epoch addSegment() tags its new subtrees with
+	deque<Segment> 			_edits; // inserted segments, never moved
+	mutex 					_editLock; // one editor, or walkSegment(), at a time
+
+	TrapezoidMap():_rootNode(nullptr), _gridX(0), _gridY(0), _published(0), _editEpoch(0){}
 	
 	void 		addSegment(Segment* segment); // add segment into T and D
 
@@ -221,8 +536,27 @@ public:
 
 	void 		Case1(GraphNode* tpNode, Segment* segment);
 	void		Case2(GraphNode* pLeft, GraphNode* pRight, Segment* segment);
-	void		buildMap(std::vector<Segment>& segments);
+	void		buildMap(std::vector<Segment>& segments,
+						 Point boxMin = Point(-100, -100), Point boxMax = Point(100, 100));
+	void		buildMapParallel(const std::vector<Segment>& segments, int strips); // one thread per vertical strip
+
+	void 		buildGrid(int nx, int ny); // precompute deepest DAG entry node per grid cell
+	GraphNode* 	gridEntry(Point pt); // DAG node to start a query from
+	void 		windowQuery(Point lo, Point hi, vector<const Segment*>& out); // segments meeting a window, one per id
+	void 		walkSegment(Segment query, vector<const Trapezoid*>& trapezoids,
+							vector<const Segment*>& crossed); // trapezoids and segments a query segment passes
+	void 		indexVerticals(); // fill _verticals from _segments
+
+	int 		insertSegment(const Segment& segment); // add a segment as a new edit epoch, returns it
+	int 		epoch() const {return _published.load(memory_order_acquire);} // latest published epoch
+	EpochTrapezoid localizeAt(Point pt, int epoch) const; // trapezoid of pt as of an epoch, lock-free
+
+	void 		freeze(); // flatten the finished DAG for localizeBatch
+	void 		localizeBatch(const Point* pts, int n, const Trapezoid** out); // localize n points in lockstep
+	bool 		save(const char* path); // freeze and write a map image
+	size_t 		pointerBytes(); // memory held by the reachable DAG, trapezoids and segments
+	int 		labelFaces(); // freeze and give every trapezoid its face id, returns the face count
 
-	~TrapezoidMap(){}
+	~TrapezoidMap(); // frees the DAG, its trapezoids and the strip maps
 
 };
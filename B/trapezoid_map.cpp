@@ -11,7 +11,7 @@
 GraphNode* TrapezoidMap::mapQuery(Point pTarget,Point pExtra)
 {
 	assert(_rootNode);
-	GraphNode* curNode = _rootNode;
+	GraphNode* curNode = this->gridEntry(pTarget);
 	while (!curNode->getTrapezoid())
 	{
 		curNode = curNode->nextNode(pTarget,pExtra);
@@ -35,25 +35,28 @@ const Trapezoid* TrapezoidMap::localize(Point pt)
  * BuildMap method
  * Constructs the trapezoid map from a set of segments
  * @segments: Vector of segments to be added to the map
+ * @boxMin, @boxMax: Corners of the bounding box
  * This function initializes the bounding box and creates the root node
  * It then adds each segment to the map using the addSegment method
  */
-void TrapezoidMap::buildMap(std::vector<Segment>& segments)
+void TrapezoidMap::buildMap(std::vector<Segment>& segments, Point boxMin, Point boxMax)
 {
-	if (segments.size() < 2) return;
-
 	// random shuffle the input
 	random_device rd;
 	default_random_engine rng(rd());
 	shuffle(segments.begin(), segments.end(), rng);
 
 	_segments = segments;
+	// the box segments are pointed to, so they must not reallocate
+	_segments.reserve(_segments.size() + 2);
 
 	//bounding box Initialize with bounding box
-	float minX = -100;
-	float minY = -100;
-	float maxX = 100;
-	float maxY = 100;
+	float minX = boxMin.x;
+	float minY = boxMin.y;
+	float maxX = boxMax.x;
+	float maxY = boxMax.y;
+	_boxMin = boxMin;
+	_boxMax = boxMax;
 
 	Trapezoid* tp = new Trapezoid;
 	_segments.push_back(Segment(Point(minX, maxY), Point(maxX, maxY)));
@@ -70,8 +73,210 @@ void TrapezoidMap::buildMap(std::vector<Segment>& segments)
 		// add segments 
 		this->addSegment(&segment);
 	}
+	indexVerticals();
 }
 
+/**
+ * TrapezoidMap destructor
+ * Frees every DAG node reachable from the root, with the leaves that
+ * subtrees replaced (kept for older epochs), and with each leaf its
+ * trapezoid. The strip maps of a parallel build hang below the x-split
+ * tree, so their DAGs are freed with it and only the strip objects are
+ * deleted. Segments are owned by their vectors and not touched.
+ */
+TrapezoidMap::~TrapezoidMap()
+{
+	for (TrapezoidMap* strip : _strips)
+	{
+		strip->_rootNode = nullptr;
+		delete strip;
+	}
+	if (!_rootNode) return;
+
+	unordered_set<GraphNode*> seen;
+	vector<GraphNode*> stack(1, _rootNode);
+	seen.insert(_rootNode);
+	while (!stack.empty())
+	{
+		GraphNode* node = stack.back();
+		stack.pop_back();
+		for (GraphNode* next : {node->_left, node->_right, node->_replaced})
+			if (next && seen.insert(next).second) stack.push_back(next);
+	}
+	for (GraphNode* node : seen) delete node;
+}
+
+/**
+ * Trapezoids along a vertical line
+ * Collects the trapezoids of the DAG below node that contain points
+ * arbitrarily close to the line x = c, on its left side if fromLeft is set
+ * and on its right side otherwise. XNodes are followed on one side only, so
+ * only the part of the DAG along the line is visited.
+ */
+static void trapezoidsAtX(GraphNode* node, float c, bool fromLeft,
+						  unordered_set<GraphNode*>& seen, vector<Trapezoid*>& out)
+{
+	if (!seen.insert(node).second) return;
+	if (node->getTrapezoid())
+	{
+		out.push_back(node->getTrapezoid());
+		return;
+	}
+	if (XNode* xn = dynamic_cast<XNode*>(node))
+	{
+		bool left = fromLeft ? c <= xn->_point : c < xn->_point;
+		trapezoidsAtX(left ? node->_left : node->_right, c, fromLeft, seen, out);
+		return;
+	}
+	trapezoidsAtX(node->_left, c, fromLeft, seen, out);
+	trapezoidsAtX(node->_right, c, fromLeft, seen, out);
+}
+
+/**
+ * BuildMapParallel method
+ * Constructs the trapezoid map from independent vertical strips
+ * @segments: Segments to be added to the map
+ * @strips: Number of strips, each built by its own thread
+ * Strip boundaries are placed in the widest gap between distinct endpoint
+ * x-coordinates near each quantile, so no endpoint lies on a boundary.
+ * Segments are clipped into every strip they cross and each strip is built
+ * with buildMap in its own box. The trapezoids on both sides of a boundary
+ * are linked as neighbours, then a balanced tree of XNodes on the
+ * boundaries is put on top of the strip DAGs. Queries return the same top
+ * and bottom segments (by id) as the sequential map, but trapezoids are
+ * also split at the boundaries. If the two sides of a boundary do not pair
+ * up, the strips are freed and the map is built serially by buildMap
+ * instead, leaving _strips empty.
+ */
+void TrapezoidMap::buildMapParallel(const std::vector<Segment>& segments, int strips)
+{
+	_segments = segments;
+	_boxMin = Point(-100, -100);
+	_boxMax = Point(100, 100);
+
+	// strip boundaries
+	vector<float> xs;
+	for (const auto& seg : segments)
+	{
+		xs.push_back(seg.ptLeft.x);
+		xs.push_back(seg.ptRight.x);
+	}
+	sort(xs.begin(), xs.end());
+	xs.erase(unique(xs.begin(), xs.end()), xs.end());
+	vector<float> bounds;
+	size_t window = xs.size() / (4 * max(strips, 1));
+	for (int j = 1; j < strips; ++j)
+	{
+		// widest gap near the quantile, so clipped pieces are not needlessly short
+		size_t q = xs.size() * j / strips, k = q;
+		if (q == 0 || q >= xs.size()) continue;
+		for (size_t i = max(q, window + 1) - window; i <= q + window && i < xs.size(); ++i)
+			if (xs[i] - xs[i - 1] > xs[k] - xs[k - 1]) k = i;
+		float b = (xs[k - 1] + xs[k]) / 2;
+		// adjacent floats have no value strictly between them
+		if (b <= xs[k - 1] || b >= xs[k] || b <= _boxMin.x || b >= _boxMax.x) continue;
+		if (bounds.empty() || b > bounds.back()) bounds.push_back(b);
+	}
+	int n = bounds.size() + 1;
+	auto stripOf = [&](float x) { return (int)(upper_bound(bounds.begin(), bounds.end(), x) - bounds.begin()); };
+
+	// clip segments into the strips they cross
+	_stripSegments.assign(n, vector<Segment>());
+	for (auto seg : segments)
+	{
+		int sl = stripOf(seg.ptLeft.x), sr = stripOf(seg.ptRight.x);
+		for (int s = sl; s <= sr; ++s)
+		{
+			Point lo = (s == sl) ? seg.ptLeft : seg.ptWithX(bounds[s - 1]);
+			Point hi = (s == sr) ? seg.ptRight : seg.ptWithX(bounds[s]);
+			_stripSegments[s].push_back(Segment(lo, hi, seg.id));
+		}
+	}
+
+	// build the strips concurrently
+	_strips.assign(n, nullptr);
+	vector<thread> workers;
+	for (int s = 0; s < n; ++s)
+	{
+		_strips[s] = new TrapezoidMap;
+		Point lo(s == 0 ? _boxMin.x : bounds[s - 1], _boxMin.y);
+		Point hi(s == n - 1 ? _boxMax.x : bounds[s], _boxMax.y);
+		workers.emplace_back([this, s, lo, hi]() { _strips[s]->buildMap(_stripSegments[s], lo, hi); });
+	}
+	for (auto& worker : workers) worker.join();
+
+	// link neighbours across each boundary; both sides see the same crossing
+	// pieces, so the trapezoids pair up in order of their bottom segment
+	for (int s = 0; s + 1 < n; ++s)
+	{
+		float b = bounds[s];
+		auto botY = [b](Trapezoid* tp)
+		{
+			Segment* seg = tp->bot;
+			if (seg->ptRight.x == b) return seg->ptRight.y;
+			if (seg->ptLeft.x == b) return seg->ptLeft.y;
+			return seg->ptWithX(b).y;
+		};
+		auto byBot = [&](Trapezoid* a, Trapezoid* c) { return botY(a) < botY(c); };
+		vector<Trapezoid*> lefts, rights, found;
+		unordered_set<GraphNode*> seen;
+		trapezoidsAtX(_strips[s]->_rootNode, b, true, seen, found);
+		for (auto tp : found) if (tp->right.x == b && tp->left.x < b) lefts.push_back(tp);
+		found.clear();
+		seen.clear();
+		trapezoidsAtX(_strips[s + 1]->_rootNode, b, false, seen, found);
+		for (auto tp : found) if (tp->left.x == b && tp->right.x > b) rights.push_back(tp);
+		if (lefts.size() != rights.size())
+		{
+			// the strips disagree at this boundary; an unlinked boundary would
+			// break walks across it, so build the whole map serially instead.
+			// No strip is joined yet, so each frees its own DAG
+			for (TrapezoidMap* strip : _strips) delete strip;
+			_strips.clear();
+			_stripSegments.assign(1, segments);
+			buildMap(_stripSegments[0]);
+			return;
+		}
+		sort(lefts.begin(), lefts.end(), byBot);
+		sort(rights.begin(), rights.end(), byBot);
+		for (size_t i = 0; i < lefts.size(); ++i)
+		{
+			lefts[i]->setOneRight(rights[i]);
+			rights[i]->setOneLeft(lefts[i]);
+		}
+	}
+
+	// x-split tree over the strip roots, once every boundary is linked
+	function<GraphNode*(int, int)> combine = [&](int lo, int hi) -> GraphNode*
+	{
+		if (hi - lo == 1) return _strips[lo]->_rootNode;
+		int mid = (lo + hi) / 2;
+		GraphNode* node = new XNode(bounds[mid - 1]);
+		node->attachLeft(combine(lo, mid));
+		node->attachRight(combine(mid, hi));
+		return node;
+	};
+	_rootNode = combine(0, n);
+	indexVerticals();
+}
+
+/**
+ * IndexVerticals method
+ * Sorts the vertical segments by x and then by lower end, so the one a
+ * vertical line meets at a given height is found by binary search
+ */
+static bool verticalOrder(const Segment* a, const Segment* b)
+{
+	return a->ptLeft.x != b->ptLeft.x ? a->ptLeft.x < b->ptLeft.x : min(a->ptLeft.y, a->ptRight.y) < min(b->ptLeft.y, b->ptRight.y);
+}
+
+void TrapezoidMap::indexVerticals()
+{
+	_verticals.clear();
+	for (const Segment& seg : _segments)
+		if (seg.vertical && seg.id >= 0) _verticals.push_back(&seg);
+	sort(_verticals.begin(), _verticals.end(), verticalOrder);
+}
 
 /**
  * GetNextIntersecting method
@@ -86,9 +291,13 @@ Trapezoid* getNextIntersecting(Segment* segment, Trapezoid* tr)
 	assert(tr->trRightTop || tr->trRightBot);
 	if(tr->trRightTop==nullptr) return tr->trRightBot;
 	if(tr->trRightBot==nullptr) return tr->trRightTop;
+	// the two right neighbours are split at tr->right; the segment goes into
+	// the upper one when that point lies below it. A point on the segment (a
+	// shared endpoint) is compared like mapQuery() does, guided by ptLeft
+	int side = segment->orient(tr->right);
+	if (side != 0) return side < 0 ? tr->trRightTop : tr->trRightBot;
 	Trapezoid* trNext;
-	Point pt = segment->ptWithX(tr->trRightTop->left.x);
-	if (tr->trRightTop->bot->isAbove(pt, segment->ptLeft))
+	if (tr->trRightTop->bot->isAbove(tr->right, segment->ptLeft))
 	{
 		trNext = tr->trRightTop;
 	}
@@ -99,6 +308,140 @@ Trapezoid* getNextIntersecting(Segment* segment, Trapezoid* tr)
 	return trNext;
 }
 
+/**
+ * Y of a segment's line at x, in double
+ * A vertical segment gives its lower end
+ */
+static double lineYAt(const Segment* seg, double x)
+{
+	if (seg->vertical) return seg->ptLeft.y;
+	double t = (x - seg->ptLeft.x) / ((double)seg->ptRight.x - seg->ptLeft.x);
+	return seg->ptLeft.y + t * ((double)seg->ptRight.y - seg->ptLeft.y);
+}
+
+/**
+ * Point where a query segment crosses a map segment, rounded to float
+ */
+static Point crossingPoint(const Segment& query, const Segment* seg)
+{
+	if (query.vertical) return Point(query.ptLeft.x, lineYAt(seg, query.ptLeft.x));
+	double ax = query.ptLeft.x, ay = query.ptLeft.y;
+	double dx = (double)query.ptRight.x - ax, dy = (double)query.ptRight.y - ay;
+	double ex = (double)seg->ptRight.x - seg->ptLeft.x, ey = (double)seg->ptRight.y - seg->ptLeft.y;
+	double t = ((seg->ptLeft.x - ax) * ey - (seg->ptLeft.y - ay) * ex) / (dx * ey - dy * ex);
+	t = max(0.0, min(1.0, t));
+	return Point(ax + t * dx, ay + t * dy);
+}
+
+/**
+ * DAG walk to the trapezoid on one side of a crossed segment
+ * Like mapQuery(), but any YNode on a piece of crossed (same id) sends the
+ * point to the given side, so rounding of the crossing point cannot put it
+ * back on the side the walk came from
+ */
+static Trapezoid* locateBeyond(GraphNode* node, Point pt, Point guide, const Segment* crossed, bool above)
+{
+	while (!node->getTrapezoid())
+	{
+		YNode* yn = dynamic_cast<YNode*>(node);
+		if (yn && yn->_segment->id == crossed->id && crossed->id >= 0)
+			node = above ? node->_left : node->_right;
+		else
+			node = node->nextNode(pt, guide);
+	}
+	return node->getTrapezoid();
+}
+
+/**
+ * WalkSegment method
+ * Walks a query segment through the finished map, e.g. to find the regions
+ * a path passes
+ * @query: Query segment, which may cross map segments
+ * @trapezoids: Output, the trapezoids it passes from left to right
+ * @crossed: Output, the map segments it crosses, in the same order
+ * The walk starts in the trapezoid of query.ptLeft and follows the right
+ * neighbours as getNextIntersecting() does during insertion. When the query
+ * leaves a trapezoid through its top or bottom segment instead, that
+ * segment is crossed and the walk goes on from the trapezoid beyond it,
+ * found by one DAG descent from the crossing point. Vertical segments lie
+ * on the walls between trapezoids, so each wall the query passes is looked
+ * up in _verticals. The cost is one neighbour step per trapezoid plus
+ * O(log n) per crossed segment and per distinct wall.
+ * Which side of a segment the query ends on at a trapezoid's right wall is
+ * decided in double; a query passing within rounding distance of a map
+ * vertex may be reported on either side of it.
+ * The walk follows the neighbour links and _verticals of the latest epoch,
+ * which editors rewrite in place, so it holds the edit lock: it waits for
+ * an insertion in progress, and insertions wait for it.
+ */
+void TrapezoidMap::walkSegment(Segment query, vector<const Trapezoid*>& trapezoids, vector<const Segment*>& crossed)
+{
+	lock_guard<mutex> lock(_editLock);
+	trapezoids.clear();
+	crossed.clear();
+	if (!_rootNode) return;
+	Trapezoid* tr = mapQuery(query.ptLeft, query.ptRight)->getTrapezoid();
+	const Segment* last = nullptr; // a straight query crosses a segment only once
+	float wall = -numeric_limits<float>::infinity(); // last wall searched for verticals
+	while (true)
+	{
+		trapezoids.push_back(tr);
+		bool ends = query.ptRight.x <= tr->right.x;
+		int top, bot;
+		if (ends)
+		{
+			top = tr->top->orient(query.ptRight);
+			bot = tr->bot->orient(query.ptRight);
+		}
+		else
+		{
+			// sides of the query's point on the right wall
+			double x = tr->right.x, y = lineYAt(&query, x);
+			const Segment* t = tr->top;
+			const Segment* b = tr->bot;
+			top = orient2d(t->ptLeft.x, t->ptLeft.y, t->ptRight.x, t->ptRight.y, x, y);
+			bot = orient2d(b->ptLeft.x, b->ptLeft.y, b->ptRight.x, b->ptRight.y, x, y);
+		}
+		Segment* through = nullptr;
+		bool above = false;
+		if (top > 0 && !(last && tr->top->id == last->id)) { through = tr->top; above = true; }
+		else if (bot < 0 && !(last && tr->bot->id == last->id)) through = tr->bot;
+		if (through)
+		{
+			if (through->id < 0) return; // leaves the box
+			crossed.push_back(through);
+			last = through;
+			tr = locateBeyond(_rootNode, crossingPoint(query, through), query.ptRight, through, above);
+			continue;
+		}
+		if (ends || (!tr->trRightTop && !tr->trRightBot)) return;
+		if (tr->right.x != wall && tr->right.x > query.ptLeft.x)
+		{
+			// at most one of the disjoint verticals on this wall spans the
+			// query's height; rounding of that height is settled exactly
+			wall = tr->right.x;
+			float y = lineYAt(&query, wall);
+			auto it = upper_bound(_verticals.begin(), _verticals.end(), make_pair(wall, y),
+								  [](pair<float, float> key, const Segment* seg)
+			{
+				float low = min(seg->ptLeft.y, seg->ptRight.y);
+				return key.first != seg->ptLeft.x ? key.first < seg->ptLeft.x : key.second < low;
+			});
+			size_t j = it - _verticals.begin();
+			for (size_t k = max<size_t>(j, 1) - 1; k <= j && k < _verticals.size(); ++k)
+			{
+				const Segment* seg = _verticals[k];
+				if (seg->ptLeft.x == wall && query.orient(seg->ptLeft) * query.orient(seg->ptRight) < 0)
+				{
+					crossed.push_back(seg);
+					break;
+				}
+			}
+		}
+		tr = getNextIntersecting(&query, tr);
+	}
+}
+
 /**
  * AddSegment method
  * Adds a segment to the trapezoid map
@@ -109,6 +452,9 @@ Trapezoid* getNextIntersecting(Segment* segment, Trapezoid* tr)
  */
 void TrapezoidMap::addSegment(Segment* segment)
 {
+	// entry nodes may be replaced below
+	_grid.clear();
+
 	GraphNode* node1 = this->mapQuery(segment->ptLeft,segment->ptRight);
 	GraphNode* node2 = this->mapQuery(segment->ptRight,segment->ptLeft);
 	Trapezoid* tp1 = node1->getTrapezoid();
@@ -126,6 +472,60 @@ void TrapezoidMap::addSegment(Segment* segment)
 	}
 }
 
+/**
+ * InsertSegment method
+ * Adds one segment to a built map as a new edit epoch
+ * @segment: Segment meeting the map's segments only at shared endpoints,
+ *           inside the bounding box
+ * Returns the epoch it published. Editors are serialized by a lock, and
+ * readers of published epochs are never blocked: the bounds of the
+ * trapezoids a segment splits are copied, never changed (their neighbour
+ * links are, under the lock), and each leaf it splits is replaced by
+ * a new subtree whose root carries the new epoch and the leaf, so
+ * localizeAt() on an older epoch steps back to the leaf. Nothing replaced
+ * is ever freed, so a pinned epoch stays valid for the life of the map.
+ * Needs a serial build: a parallel build may leave strip boundaries
+ * without the neighbour links the insertion follows. The grid and the
+ * frozen copy are not kept up to date; freeze() again for batched queries.
+ */
+int TrapezoidMap::insertSegment(const Segment& segment)
+{
+	lock_guard<mutex> lock(_editLock);
+	_edits.push_back(segment);
+	Segment* seg = &_edits.back();
+	_editEpoch = _published.load(memory_order_relaxed) + 1;
+	this->addSegment(seg);
+	if (seg->vertical) _verticals.insert(upper_bound(_verticals.begin(), _verticals.end(), seg, verticalOrder), seg);
+	_published.store(_editEpoch, memory_order_release);
+	return _editEpoch;
+}
+
+/**
+ * LocalizeAt method
+ * Finds the trapezoid containing a point in the map as of an edit epoch
+ * @pt: Point to be localized
+ * @epoch: From 0, the built map, to epoch(); clamped to that range
+ * Lock-free and safe while an editor inserts: it reads only DAG links,
+ * which editors publish with release stores, and node and trapezoid fields
+ * that never change once published. Returns those fields of the trapezoid
+ * by value; its neighbour links describe the latest epoch only and are
+ * rewritten by editors, so they are not handed out.
+ * Starts from the root, never from the grid.
+ */
+EpochTrapezoid TrapezoidMap::localizeAt(Point pt, int epoch) const
+{
+	epoch = max(0, min(epoch, this->epoch()));
+	GraphNode* node = loadAcquire(_rootNode);
+	while (true)
+	{
+		// a subtree made after the epoch stands for the leaf it replaced,
+		// which is always a leaf of that epoch
+		if (node->_epoch > epoch) node = node->_replaced;
+		if (node->getTrapezoid()) return EpochTrapezoid(*node->getTrapezoid());
+		node = node->nextNode(pt, pt);
+	}
+}
+
 /**
  * Case1 method
  * Handles the case where a segment lies completely inside one trapezium
@@ -185,11 +585,13 @@ void TrapezoidMap::Case1(GraphNode* tpNode, Segment* segment)
 	
 	if (tpNode == _rootNode)
 	{
-		_rootNode = newRoot;
+		newRoot->_epoch = _editEpoch;
+		newRoot->_replaced = tpNode;
+		storeRelease(_rootNode, newRoot);
 	}
 	else
 	{
-		tpNode->replaceWith(newRoot);
+		tpNode->replaceWith(newRoot, _editEpoch);
 	}
 }
 
@@ -238,7 +640,7 @@ void TrapezoidMap::Case2(GraphNode* pLeft, GraphNode* pRight, Segment* segment)
 	newLeft->attachRight(newSplit);
 	newSplit->attachLeft(terminalTop);
 	newSplit->attachRight(terminalBot);
-	trBegin->graphNode->replaceWith(newLeft);
+	trBegin->graphNode->replaceWith(newLeft, _editEpoch);
 	Trapezoid* trPrev = trBegin;Trapezoid* trCurrent = getNextIntersecting(segment, trBegin);
 
 	//middle intersecting
@@ -306,7 +708,7 @@ void TrapezoidMap::Case2(GraphNode* pLeft, GraphNode* pRight, Segment* segment)
 		newSplit = new YNode(segment);
 		newSplit->attachLeft(terminalTop);
 		newSplit->attachRight(terminalBot);
-		trCurrent->graphNode->replaceWith(newSplit);
+		trCurrent->graphNode->replaceWith(newSplit, _editEpoch);
 
 		trPrev = trCurrent;
 		trCurrent = getNextIntersecting(segment, trCurrent);
@@ -333,6 +735,153 @@ void TrapezoidMap::Case2(GraphNode* pLeft, GraphNode* pRight, Segment* segment)
 	newRight->attachLeft(newSplit);
 	newSplit->attachLeft(terminalTop);
 	newSplit->attachRight(terminalBot);
-	trEnd->graphNode->replaceWith(newRight);
+	trEnd->graphNode->replaceWith(newRight, _editEpoch);
 	
 }
+
+/**
+ * BuildGrid method
+ * Precomputes a uniform grid of DAG entry nodes over the bounding box
+ * @nx: Number of cells along x
+ * @ny: Number of cells along y (1 gives plain x-buckets)
+ * For every cell the DAG is descended as long as the whole cell takes the same
+ * branch, and the node reached is stored. Queries falling in the cell start
+ * there and skip the levels above it. Memory is one pointer per cell.
+ * The grid is dropped by addSegment, so build it once the map is complete.
+ */
+void TrapezoidMap::buildGrid(int nx, int ny)
+{
+	_grid.clear();
+	_gridX = nx;
+	_gridY = ny;
+	if (nx <= 0 || ny <= 0 || !_rootNode) return;
+
+	float w = (_boxMax.x - _boxMin.x) / nx;
+	float h = (_boxMax.y - _boxMin.y) / ny;
+	// widen cells slightly so points rounded into a cell are still inside its box
+	float mx = 1e-3f + w * 1e-3f;
+	float my = 1e-3f + h * 1e-3f;
+	_grid.resize((size_t)nx * ny);
+	for (int j = 0; j < ny; ++j)
+	{
+		for (int i = 0; i < nx; ++i)
+		{
+			Point lo(_boxMin.x + i * w - mx, _boxMin.y + j * h - my);
+			Point hi(_boxMin.x + (i + 1) * w + mx, _boxMin.y + (j + 1) * h + my);
+			GraphNode* node = _rootNode;
+			while (!node->getTrapezoid())
+			{
+				GraphNode* next = node->nextNodeBox(lo, hi);
+				if (!next) break;
+				node = next;
+			}
+			_grid[(size_t)j * nx + i] = node;
+		}
+	}
+}
+
+/**
+ * Disjoint sets over the two sides of every segment, used by labelFaces()
+ * Side 2 * id is the region just above segment id, 2 * id + 1 the region
+ * just below it, and the last element is the outer face (the box)
+ */
+struct SideSets
+{
+	vector<int> parent;
+	SideSets(int n): parent(n) { iota(parent.begin(), parent.end(), 0); }
+	int find(int a)
+	{
+		while (parent[a] != a) a = parent[a] = parent[parent[a]];
+		return a;
+	}
+	void join(int a, int b) { parent[find(a)] = find(b); }
+};
+
+/**
+ * LabelFaces method
+ * Assigns every trapezoid the id of the face of the subdivision it lies in
+ * Segments are assumed to meet only at shared endpoints. Then everything
+ * just above one segment is a single face, and the faces are the classes
+ * of segment sides under two rules:
+ * - a trapezoid of positive width joins the side above its bottom segment
+ *   with the side below its top segment
+ * - around a shared endpoint, consecutive segments in angular order bound
+ *   one wedge, which joins the side of one with the side of the next
+ * The neighbour links are not followed: the zero-width trapezoids left at
+ * shared endpoints keep stale links and segments, and would merge faces.
+ * The outer face is face 0. Queries then read tr->face in O(1) after localize().
+ */
+int TrapezoidMap::labelFaces()
+{
+	freeze();
+	int ids = 0;
+	for (const Segment& seg : _segments) ids = max(ids, seg.id + 1);
+	const int outer = 2 * ids;
+	SideSets sides(outer + 1);
+	auto above = [&](const Segment* seg) { return seg->id < 0 ? outer : 2 * seg->id; };
+	auto below = [&](const Segment* seg) { return seg->id < 0 ? outer : 2 * seg->id + 1; };
+
+	for (Trapezoid* tp : _flat.trapezoids)
+		if (tp->left.x < tp->right.x) sides.join(above(tp->bot), below(tp->top));
+
+	// segment ends grouped by point; atLeft tells which end of the segment it is
+	struct End { Point pt; Point other; const Segment* seg; bool atLeft; };
+	vector<End> ends;
+	for (const Segment& seg : _segments)
+	{
+		if (seg.id < 0) continue;
+		ends.push_back({seg.ptLeft, seg.ptRight, &seg, true});
+		ends.push_back({seg.ptRight, seg.ptLeft, &seg, false});
+	}
+	sort(ends.begin(), ends.end(), [](const End& a, const End& b)
+	{
+		return a.pt.x != b.pt.x ? a.pt.x < b.pt.x : a.pt.y < b.pt.y;
+	});
+	for (size_t i = 0, j; i < ends.size(); i = j)
+	{
+		for (j = i + 1; j < ends.size() && ends[j].pt.x == ends[i].pt.x && ends[j].pt.y == ends[i].pt.y; ++j);
+		Point p = ends[i].pt;
+		// counterclockwise from the positive x axis, exactly
+		auto upper = [&](const End& e) { return e.other.y > p.y || (e.other.y == p.y && e.other.x > p.x); };
+		sort(ends.begin() + i, ends.begin() + j, [&](const End& a, const End& b)
+		{
+			if (upper(a) != upper(b)) return upper(a);
+			return orient2d(p.x, p.y, a.other.x, a.other.y, b.other.x, b.other.y) > 0;
+		});
+		// the wedge counterclockwise of a segment leaving p is on its left:
+		// above it when p is its left end, below it otherwise
+		for (size_t k = i; k < j; ++k)
+		{
+			const End& from = ends[k];
+			const End& to = ends[k + 1 < j ? k + 1 : i];
+			sides.join(from.atLeft ? above(from.seg) : below(from.seg),
+					   to.atLeft ? below(to.seg) : above(to.seg));
+		}
+	}
+
+	vector<int> label(outer + 1, -1);
+	int faces = 0;
+	label[sides.find(outer)] = faces++;
+	for (Trapezoid* tp : _flat.trapezoids)
+	{
+		int root = sides.find(above(tp->bot));
+		if (label[root] < 0) label[root] = faces++;
+		tp->face = label[root];
+	}
+	return faces;
+}
+
+/**
+ * GridEntry method
+ * Returns the DAG node a query for pt can start from
+ * @pt: Query point
+ * Falls back to the root when there is no grid or pt is outside the box
+ */
+GraphNode* TrapezoidMap::gridEntry(Point pt)
+{
+	if (_grid.empty() || pt.x < _boxMin.x || pt.x >= _boxMax.x || pt.y < _boxMin.y || pt.y >= _boxMax.y)
+		return _rootNode;
+	int i = min(_gridX - 1, (int)((pt.x - _boxMin.x) / (_boxMax.x - _boxMin.x) * _gridX));
+	int j = min(_gridY - 1, (int)((pt.y - _boxMin.y) / (_boxMax.y - _boxMin.y) * _gridY));
+	return _grid[(size_t)j * _gridX + i];
+}
@@ -0,0 +1,56 @@
+#ifndef LOCATOR_H
+#define LOCATOR_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * InputSegment struct
+ * A segment as read from the input, before either engine converts it
+ * id is the index of the segment in the input
+ */
+struct InputSegment
+{
+	double x1, y1, x2, y2;
+	int id;
+};
+
+/**
+ * Location struct
+ * Answer to a point query: ids of the input segments just above and just
+ * below the point, -1 where there is none (the bounding box for the
+ * trapezoidal map, nothing at all for the slabs). A point is located as if
+ * just right of its x, so a segment ending there does not count. A point
+ * on a vertical segment gets that segment as both; a point on other
+ * segments gets as both the lowest of them just right of it
+ */
+struct Location
+{
+	int above;
+	int below;
+};
+
+/**
+ * Locator class
+ * Common interface of the point-location engines
+ * build() may be called once per engine object; locate() answers a batch
+ * of points after it; bytes() is the memory held by the built structure.
+ * Segments must meet only at shared endpoints and lie in the default box
+ * [-100, 100]^2, as both programs expect.
+ */
+class Locator
+{
+public:
+	virtual ~Locator() {}
+	virtual const char* name() const = 0;
+	virtual void build(const std::vector<InputSegment>& segments) = 0;
+	virtual void locate(const double* xy, int n, Location* out) = 0; // xy holds n (x, y) pairs
+	virtual size_t bytes() = 0;
+};
+
+// engines; threads > 1 builds in parallel
+typedef Locator* (*LocatorFactory)(int threads);
+Locator* makeSlabLocator(int threads); // persistent slab tree of A/VD.cpp
+Locator* makeTrapezoidLocator(int threads); // randomized trapezoidal map of B
+
+#endif
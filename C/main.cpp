@@ -0,0 +1,282 @@
+#include <bits/stdc++.h>
+#include "locator.h"
+#include "../B/result_writer.h"
+
+using namespace std;
+
+// calibration queries per sample build
+static const int CALIBRATION_QUERIES = 4096;
+
+/**
+ * Estimate struct
+ * Predicted cost of one engine on the whole input
+ * buildExponent and querySlope are the fitted growth of build time (power
+ * of n) and of query time (nanoseconds per doubling of n)
+ */
+struct Estimate
+{
+	const char* name;
+	double 		buildSeconds;
+	double 		queryNs;
+	double 		bytes;
+	double 		buildExponent;
+	double 		querySlope;
+	double 		total; // build plus the expected queries, seconds
+	bool 		fits; // within the memory budget
+};
+
+static double secondsSince(chrono::steady_clock::time_point t0)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+/**
+ * Measure one sample build
+ * Builds the engine on the sample, then times batched queries over the
+ * calibration points in rounds for at least 20 ms and keeps the fastest
+ * round, so a stray interruption does not skew the choice
+ */
+static void measure(Locator* engine, const vector<InputSegment>& sample, const vector<double>& probe,
+					double& buildSeconds, double& queryNs, double& bytes)
+{
+	auto t0 = chrono::steady_clock::now();
+	engine->build(sample);
+	buildSeconds = secondsSince(t0);
+	bytes = engine->bytes();
+
+	int n = probe.size() / 2;
+	vector<Location> answers(n);
+	engine->locate(probe.data(), n, answers.data()); // warm up
+	double best = numeric_limits<double>::max();
+	auto start = chrono::steady_clock::now();
+	for (int round = 0; round < 3 || secondsSince(start) < 0.02; ++round)
+	{
+		t0 = chrono::steady_clock::now();
+		engine->locate(probe.data(), n, answers.data());
+		best = min(best, secondsSince(t0));
+	}
+	queryNs = best * 1e9 / n;
+}
+
+/**
+ * Calibrate one engine
+ * @make: Engine factory
+ * @samples: Two nested random samples of the input, the small one first
+ * @n: Input size to extrapolate to
+ * Build time is fitted as a power of the segment count, with the exponent
+ * clamped to [1, 2]; query time as a line in log n, never decreasing;
+ * memory as linear in n. With one sample (the input is small) it is the
+ * measurement itself
+ */
+static Estimate calibrate(LocatorFactory make, int threads, const vector<vector<InputSegment>>& samples,
+						  const vector<double>& probe, size_t n)
+{
+	double build[2], query[2], bytes[2];
+	Estimate est = Estimate();
+	for (size_t s = 0; s < samples.size(); ++s)
+	{
+		Locator* engine = make(threads);
+		est.name = engine->name();
+		measure(engine, samples[s], probe, build[s], query[s], bytes[s]);
+		delete engine;
+	}
+	size_t m = samples.back().size();
+	est.buildExponent = 1;
+	if (samples.size() == 2 && build[0] > 0)
+	{
+		double ratio = log((double)m / samples[0].size());
+		est.buildExponent = min(2.0, max(1.0, log(build[1] / build[0]) / ratio));
+		est.querySlope = max(0.0, (query[1] - query[0]) / log2((double)m / samples[0].size()));
+	}
+	double scale = (double)n / m;
+	est.buildSeconds = build[samples.size() - 1] * pow(scale, est.buildExponent);
+	est.queryNs = query[samples.size() - 1] + est.querySlope * log2(scale);
+	est.bytes = bytes[samples.size() - 1] * scale;
+	return est;
+}
+
+/**
+ * Choose an engine for the input
+ * Calibrates both engines on random samples and picks the one with the
+ * least estimated build plus query time among those within the memory
+ * budget (the smaller one if neither fits), printing the estimates and
+ * the reason
+ * @expectedQueries: Queries the built engine will answer
+ * @sampleSize: Segments in the larger sample
+ * @budgetBytes: Memory budget, 0 for none
+ */
+static LocatorFactory chooseEngine(const vector<InputSegment>& segments, const vector<double>& queries, int threads,
+								   double expectedQueries, size_t sampleSize, double budgetBytes)
+{
+	size_t n = segments.size();
+	mt19937 rng(12345);
+
+	// nested samples; a subset of segments meeting only at endpoints still does
+	vector<InputSegment> shuffled(segments);
+	shuffle(shuffled.begin(), shuffled.end(), rng);
+	size_t large = min(n, max<size_t>(sampleSize, 1));
+	size_t small = large / 4;
+	vector<vector<InputSegment>> samples;
+	if (small >= 256 && large < n) samples.emplace_back(shuffled.begin(), shuffled.begin() + small);
+	samples.emplace_back(shuffled.begin(), shuffled.begin() + large);
+
+	// calibration points: the input's own queries, else uniform in the box of the segments
+	vector<double> probe;
+	int queryCount = queries.size() / 2;
+	if (queryCount > 0)
+	{
+		uniform_int_distribution<int> pick(0, queryCount - 1);
+		for (int i = 0; i < CALIBRATION_QUERIES; ++i)
+		{
+			int q = queryCount <= CALIBRATION_QUERIES ? i % queryCount : pick(rng);
+			probe.push_back(queries[2 * q]);
+			probe.push_back(queries[2 * q + 1]);
+		}
+	}
+	else
+	{
+		double lo[2] = {100, 100}, hi[2] = {-100, -100};
+		for (const InputSegment& seg : segments)
+		{
+			lo[0] = min(lo[0], min(seg.x1, seg.x2));
+			hi[0] = max(hi[0], max(seg.x1, seg.x2));
+			lo[1] = min(lo[1], min(seg.y1, seg.y2));
+			hi[1] = max(hi[1], max(seg.y1, seg.y2));
+		}
+		for (int i = 0; i < CALIBRATION_QUERIES; ++i)
+			for (int k = 0; k < 2; ++k)
+				probe.push_back(uniform_real_distribution<double>(lo[k], max(lo[k], hi[k]))(rng));
+	}
+
+	vector<double> xs;
+	for (const InputSegment& seg : segments)
+	{
+		xs.push_back(seg.x1);
+		xs.push_back(seg.x2);
+	}
+	sort(xs.begin(), xs.end());
+	size_t distinct = unique(xs.begin(), xs.end()) - xs.begin();
+	cout << "input: " << n << " segments, " << distinct << " distinct x of " << 2 * n << " endpoints, "
+		 << expectedQueries << " queries expected" << endl;
+	cout << "calibration: samples of";
+	for (auto& sample : samples) cout << " " << sample.size();
+	cout << " segments, " << probe.size() / 2 << (queryCount ? " input" : " uniform") << " query points" << endl;
+
+	LocatorFactory makes[2] = {makeSlabLocator, makeTrapezoidLocator};
+	Estimate est[2];
+	for (int e = 0; e < 2; ++e)
+	{
+		est[e] = calibrate(makes[e], threads, samples, probe, n);
+		est[e].total = est[e].buildSeconds + expectedQueries * est[e].queryNs * 1e-9;
+		est[e].fits = budgetBytes <= 0 || est[e].bytes <= budgetBytes;
+		cout << est[e].name << ": build " << est[e].buildSeconds << " s (n^" << est[e].buildExponent << "), query "
+			 << est[e].queryNs << " ns (+" << est[e].querySlope << " ns per doubling), memory "
+			 << est[e].bytes / (1 << 20) << " MB, total " << est[e].total << " s" << endl;
+	}
+
+	int pick;
+	if (est[0].fits != est[1].fits)
+	{
+		pick = est[0].fits ? 0 : 1;
+		cout << "chose " << est[pick].name << ": " << est[1 - pick].name << " exceeds the memory budget of "
+			 << budgetBytes / (1 << 20) << " MB" << endl;
+	}
+	else if (!est[0].fits)
+	{
+		pick = est[0].bytes <= est[1].bytes ? 0 : 1;
+		cout << "chose " << est[pick].name << ": neither fits the memory budget of " << budgetBytes / (1 << 20)
+			 << " MB and it needs less" << endl;
+	}
+	else
+	{
+		pick = est[0].total <= est[1].total ? 0 : 1;
+		const Estimate& win = est[pick];
+		const Estimate& lose = est[1 - pick];
+		const char* reason = win.buildSeconds <= lose.buildSeconds
+			? (win.queryNs <= lose.queryNs ? "faster build and queries" : "its faster build outweighs slower queries")
+			: "its faster queries outweigh a slower build";
+		cout << "chose " << win.name << ": " << reason << ", " << win.total << " s against " << lose.total
+			 << " s for build and queries" << endl;
+	}
+	return makes[pick];
+}
+
+int main(int argc, char* argv[])
+{
+	// Optional flags: --engine auto|slab|trapezoid (auto calibrates both on samples),
+	// --format text|binary (results file), --threads T (parallel build),
+	// --queries Q (queries to plan for, default the input's), --sample M (larger calibration sample),
+	// --budget MB (memory budget for auto)
+	string engineName = "auto";
+	bool binary = false;
+	int threads = 1;
+	double expectedQueries = -1;
+	size_t sampleSize = 20000;
+	double budgetMb = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--engine" && i + 1 < argc) engineName = argv[++i];
+		else if (arg == "--format" && i + 1 < argc) binary = string(argv[++i]) == "binary";
+		else if (arg == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (arg == "--queries" && i + 1 < argc) expectedQueries = atof(argv[++i]);
+		else if (arg == "--sample" && i + 1 < argc) sampleSize = atol(argv[++i]);
+		else if (arg == "--budget" && i + 1 < argc) budgetMb = atof(argv[++i]);
+	}
+	ios::sync_with_stdio(false);
+	cin.tie(nullptr);
+
+	int N;
+	cin >> N;
+	vector<InputSegment> segments(N);
+	for (int i = 0; i < N; ++i)
+	{
+		InputSegment& seg = segments[i];
+		cin >> seg.x1 >> seg.y1 >> seg.x2 >> seg.y2;
+		seg.id = i;
+	}
+	// one query point per line until end of input
+	vector<double> queries;
+	double xq, yq;
+	while (cin >> xq >> yq)
+	{
+		queries.push_back(xq);
+		queries.push_back(yq);
+	}
+	if (expectedQueries < 0) expectedQueries = queries.size() / 2;
+
+	LocatorFactory make = nullptr;
+	if (engineName == "slab") make = makeSlabLocator;
+	else if (engineName == "trapezoid") make = makeTrapezoidLocator;
+	else if (engineName == "auto")
+		make = chooseEngine(segments, queries, threads, expectedQueries, sampleSize, budgetMb * (1 << 20));
+	else
+	{
+		cerr << "unknown engine " << engineName << endl;
+		return 1;
+	}
+
+	Locator* engine = make(threads);
+	auto t0 = chrono::steady_clock::now();
+	engine->build(segments);
+	cout << engine->name() << ": built in " << secondsSince(t0) << " s, " << engine->bytes() / double(1 << 20)
+		 << " MB" << endl;
+
+	int n = queries.size() / 2;
+	vector<Location> answers(n);
+	t0 = chrono::steady_clock::now();
+	engine->locate(queries.data(), n, answers.data());
+	if (n > 0) cout << engine->name() << ": " << n << " queries, " << secondsSince(t0) * 1e9 / n << " ns each" << endl;
+
+	// text lines QUERY x y above below, or records of (query index, above, below); -1 for none
+	ResultWriter out;
+	out.open(binary ? "data.bin" : "data.txt", binary);
+	for (int i = 0; i < n; ++i)
+	{
+		int record[3] = {i, answers[i].above, answers[i].below};
+		out.record(record, 3);
+		out.line("QUERY %g %g %d %d\n", queries[2 * i], queries[2 * i + 1], answers[i].above, answers[i].below);
+	}
+	delete engine;
+	return 0;
+}
@@ -0,0 +1,102 @@
+// A/VD.cpp is a single-file program; it is compiled here inside its own
+// namespace, with its system headers included first so their guards keep
+// them out of the namespace, and without its main
+#include <bits/stdc++.h>
+#include <immintrin.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "locator.h"
+
+#define VD_NO_MAIN
+namespace slab
+{
+#include "../A/VD.cpp"
+}
+
+/**
+ * SlabLocator class
+ * PointLocation of A/VD.cpp behind the Locator interface
+ * Queries run through the frozen tree with the lockstep kernel. The walk
+ * gives a point on segments the lowest of them as above and the highest
+ * as below; below is set to above, as the Location contract asks.
+ * PointLocation keeps its slab boundaries in the global x_coords, so every
+ * engine keeps its own and swaps them in for the length of each call; any
+ * number of slab engines can be built and queried one at a time. The
+ * destructor frees the trees, so calibration builds do not pile up.
+ */
+class SlabLocator : public Locator
+{
+public:
+	SlabLocator(int threads): _threads(threads), _pl(nullptr) {}
+	~SlabLocator()
+	{
+		if (_pl) _pl->release();
+		delete _pl;
+	}
+
+	const char* name() const {return "slab";}
+
+	void build(const std::vector<InputSegment>& segments)
+	{
+		std::vector<slab::Segment> segs;
+		segs.reserve(segments.size());
+		for (const InputSegment& in : segments)
+		{
+			double x1 = in.x1, y1 = in.y1, x2 = in.x2, y2 = in.y2;
+			if (x1 > x2 || (x1 == x2 && y1 > y2))
+			{
+				std::swap(x1, x2);
+				std::swap(y1, y2);
+			}
+			segs.push_back(slab::Segment(slab::Point(x1, y1), slab::Point(x2, y2), in.id));
+		}
+		Slabs use(*this);
+		_pl = new slab::PointLocation(segs, _threads);
+		_pl->freeze();
+	}
+
+	void locate(const double* xy, int n, Location* out)
+	{
+		_pts.resize(n);
+		for (int i = 0; i < n; ++i) _pts[i] = slab::Point(xy[2 * i], xy[2 * i + 1]);
+		{
+			Slabs use(*this);
+			_pl->locateBatch(_pts, _result, true);
+		}
+		for (int i = 0; i < n; ++i)
+		{
+			slab::Segment* above = _result[i].first;
+			slab::Segment* below = above && above->side(_pts[i]) == 0 ? above : _result[i].second;
+			out[i].above = above ? above->id : -1;
+			out[i].below = below ? below->id : -1;
+		}
+	}
+
+	size_t bytes()
+	{
+		Slabs use(*this);
+		return _pl ? _pl->bytes() : 0;
+	}
+
+private:
+	// puts the engine's slab boundaries in the global for a scope
+	struct Slabs
+	{
+		SlabLocator& engine;
+		Slabs(SlabLocator& e): engine(e) {engine._xCoords.swap(slab::x_coords);}
+		~Slabs() {engine._xCoords.swap(slab::x_coords);}
+	};
+
+	int 										_threads;
+	slab::PointLocation* 						_pl;
+	std::vector<double> 						_xCoords; // slab boundaries while not swapped in
+	std::vector<slab::Point> 					_pts;
+	std::vector<std::pair<slab::Segment*, slab::Segment*>> _result;
+};
+
+Locator* makeSlabLocator(int threads)
+{
+	return new SlabLocator(threads);
+}
@@ -0,0 +1,78 @@
+#include "../B/structures.h"
+#include "locator.h"
+
+/**
+ * TrapezoidLocator class
+ * TrapezoidMap of B behind the Locator interface
+ * Queries run through the flattened DAG in lockstep; the top and bottom
+ * of the trapezoid found are the segments above and below, the bounding
+ * box giving -1. A point on segments gets the lowest of them as both, and
+ * on a vertical segment that segment, as the Location contract asks; both
+ * are decided in float, as B reads the coordinates.
+ * A serial build points into the segments it is given, so they are kept.
+ */
+class TrapezoidLocator : public Locator
+{
+public:
+	TrapezoidLocator(int threads): _threads(threads) {}
+
+	const char* name() const {return "trapezoid";}
+
+	void build(const vector<InputSegment>& segments)
+	{
+		_segments.reserve(segments.size());
+		for (const InputSegment& in : segments)
+			_segments.emplace_back(Point(in.x1, in.y1), Point(in.x2, in.y2), in.id);
+		if (_threads > 1) _map.buildMapParallel(_segments, _threads);
+		else _map.buildMap(_segments);
+		_map.freeze();
+	}
+
+	void locate(const double* xy, int n, Location* out)
+	{
+		_pts.resize(n);
+		_leaves.resize(n);
+		for (int i = 0; i < n; ++i) _pts[i] = Point(xy[2 * i], xy[2 * i + 1]);
+		_map._flat.query(_pts.data(), n, _leaves.data());
+		for (int i = 0; i < n; ++i)
+		{
+			const Trapezoid* tr = _map._flat.trapezoids[_leaves[i]];
+			// the query takes the trapezoid below the segments through the
+			// point, so its top is the lowest of them
+			out[i].above = tr->top->id;
+			out[i].below = tr->top->id >= 0 && tr->top->orient(_pts[i]) == 0 ? tr->top->id : tr->bot->id;
+			if (const Segment* vertical = onVertical(_pts[i])) out[i].above = out[i].below = vertical->id;
+		}
+	}
+
+	size_t bytes()
+	{
+		const FlatDag& flat = _map._flat;
+		return _map.pointerBytes() + _segments.capacity() * sizeof(Segment) + flat.nodes.capacity() * sizeof(FlatNode) +
+			   flat.trapezoids.capacity() * sizeof(Trapezoid*);
+	}
+
+private:
+	// vertical segment through pt, the lower one where two meet at pt
+	const Segment* onVertical(Point pt)
+	{
+		const vector<const Segment*>& verticals = _map._verticals;
+		auto it = lower_bound(verticals.begin(), verticals.end(), pt, [](const Segment* seg, Point p)
+		{
+			return seg->ptLeft.x != p.x ? seg->ptLeft.x < p.x : seg->ptRight.y < p.y;
+		});
+		if (it == verticals.end() || (*it)->ptLeft.x != pt.x || (*it)->ptLeft.y > pt.y) return nullptr;
+		return *it;
+	}
+
+	int 			_threads;
+	TrapezoidMap 	_map;
+	vector<Segment> _segments;
+	vector<Point> 	_pts;
+	vector<int> 	_leaves;
+};
+
+Locator* makeTrapezoidLocator(int threads)
+{
+	return new TrapezoidLocator(threads);
+}